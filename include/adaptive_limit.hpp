@@ -0,0 +1,124 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+struct AdaptiveLimitOptions {
+    size_t initial = 20;
+    size_t min = 2;
+    size_t max = 1000;
+    // Latency growth over the baseline that is accepted before backing off.
+    double tolerance = 1.5;
+    // Weight of each new estimate in the limit.
+    double smoothing = 0.2;
+    // Requests averaged into one short-term latency sample.
+    size_t window = 20;
+    // Short-term samples after which the baseline is re-measured.
+    size_t long_window = 500;
+};
+
+// Concurrency limit that finds its own value from measured latency, after
+// the gradient algorithm of Netflix's concurrency-limits. A short-term
+// average of request latency is compared with the unloaded latency (the
+// lowest short-term average lately seen): while they agree the limit grows
+// by about sqrt(limit) per window; once latency climbs past
+// tolerance * baseline the limit shrinks in proportion, so the backends run
+// near the concurrency that gives peak throughput and the excess is turned
+// away instead of queueing behind it.
+class AdaptiveLimit {
+public:
+    explicit AdaptiveLimit(const AdaptiveLimitOptions& opts = AdaptiveLimitOptions())
+        : opts(opts), estimate(clamp_limit((double)opts.initial)), current((size_t)estimate) {}
+    AdaptiveLimit(const AdaptiveLimit&) = delete;
+
+    // Admits a request unless the limit is reached. Every true must be
+    // matched by one release().
+    bool try_acquire() {
+        size_t now = running.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (now > current.load(std::memory_order_relaxed)) {
+            running.fetch_sub(1, std::memory_order_acq_rel);
+            rejections.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Ends an admitted request that took rtt_us. With sample = false the
+    // latency is ignored: failed requests are often fast and would talk the
+    // limit up.
+    void release(long long rtt_us, bool sample) {
+        size_t was = running.fetch_sub(1, std::memory_order_acq_rel);
+        if (!sample) return;
+        std::lock_guard<std::mutex> lock(mu);
+        window_sum += (double)std::max(rtt_us, 1LL);
+        window_count++;
+        window_inflight = std::max(window_inflight, was);
+        if (window_count < opts.window) return;
+        update(window_sum / window_count, window_inflight);
+        window_sum = 0;
+        window_count = 0;
+        window_inflight = 0;
+    }
+
+    size_t limit() const { return current.load(std::memory_order_relaxed); }
+    size_t inflight() const { return running.load(std::memory_order_relaxed); }
+    unsigned long long rejected() const { return rejections.load(std::memory_order_relaxed); }
+    double baseline_rtt_us() const {
+        std::lock_guard<std::mutex> lock(mu);
+        return baseline();
+    }
+
+private:
+    void update(double short_rtt, size_t peak_inflight) {
+        // The baseline is a minimum over the current and the previous
+        // long window, so it follows a backend that got slower for good
+        // (or faster) within two windows.
+        if (min_rtt == 0 || short_rtt < min_rtt) min_rtt = short_rtt;
+        if (++windows >= opts.long_window) {
+            prev_min_rtt = min_rtt;
+            min_rtt = 0;
+            windows = 0;
+            // Under steady load every sample is taken at the limit, which
+            // would let the baseline creep up with it. Halving the limit
+            // for a moment lets the new window see near-unloaded latency.
+            if (peak_inflight >= estimate / 2) {
+                estimate = clamp_limit(estimate / 2);
+                current.store((size_t)estimate, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        // Too little traffic to tell whether the limit is too low.
+        if (peak_inflight < estimate / 2) return;
+
+        double gradient = std::max(0.5, std::min(1.0, opts.tolerance * baseline() / short_rtt));
+        double next = estimate * gradient + std::sqrt(estimate);
+        estimate = clamp_limit(estimate * (1 - opts.smoothing) + next * opts.smoothing);
+        current.store((size_t)estimate, std::memory_order_relaxed);
+    }
+
+    double baseline() const {
+        if (min_rtt == 0) return prev_min_rtt;
+        if (prev_min_rtt == 0) return min_rtt;
+        return std::min(min_rtt, prev_min_rtt);
+    }
+
+    double clamp_limit(double v) const {
+        return std::max((double)std::max<size_t>(opts.min, 1), std::min((double)opts.max, v));
+    }
+
+    AdaptiveLimitOptions opts;
+    mutable std::mutex mu;
+    double estimate;
+    double min_rtt = 0;
+    double prev_min_rtt = 0;
+    size_t windows = 0;
+    double window_sum = 0;
+    size_t window_count = 0;
+    size_t window_inflight = 0;
+    std::atomic<size_t> current;
+    std::atomic<size_t> running{0};
+    std::atomic<unsigned long long> rejections{0};
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+
+// Condition attached to a cache write, as in Redis SET ... NX / XX.
+enum class CacheSetMode {
+    Always,
+    IfExists,   // XX: refreshes must not resurrect a deleted key
+    IfAbsent,   // NX: warm-up must not overwrite a newer value
+};
+
+// The look-aside cache in front of storage. Values are opaque bytes; the
+// freshness header of cache_entry.hpp is added and parsed by the server.
+// Selected with --cache=redis|memory|none.
+class CacheBackend {
+public:
+    typedef std::vector<std::pair<std::string, std::string>> Rows;
+
+    virtual ~CacheBackend() = default;
+
+    // Opens connections. Prints the reason and returns false on failure.
+    virtual bool open() = 0;
+    // One-line description for the startup banner, e.g. "Redis (3 shards)".
+    virtual std::string describe() const = 0;
+
+    // Returns false on a miss (or an error, which is treated as a miss).
+    virtual bool get(const std::string& key, std::string& val) = 0;
+    // ttl_ms = 0 means no expiry.
+    virtual void set(const std::string& key, const std::string& val, long long ttl_ms, CacheSetMode mode) = 0;
+    // Writes every row, batching round trips where the backend can.
+    virtual void set_batch(const Rows& rows, long long ttl_ms, CacheSetMode mode) = 0;
+    virtual void del(const std::string& key) = 0;
+    // 1 if cached, 0 if not, -1 if the cache could not be reached or
+    // answered with an error.
+    virtual int exists(const std::string& key) = 0;
+};
@@ -0,0 +1,101 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <cstdlib>
+
+// A value as stored in Redis when soft TTL or expiry is in use:
+//
+//     \x1e<fresh_until_ms>:<expires_at_ms>:<delta_us>\x1e<value>
+//
+// delta_us is how long the PostgreSQL fetch that produced the value took;
+// XFetch uses it to decide how early to refresh. Values written without a
+// header (or by an older server) are treated as always fresh. With both TTLs
+// off the header is left out, except for a value that itself starts with
+// the mark, which would otherwise be parsed as a header on the way back.
+struct CacheEntry {
+    long long fresh_until_ms = 0;   // soft TTL deadline, 0 = never goes stale
+    long long expires_at_ms = 0;    // Redis expiry, 0 = none
+    long long delta_us = 0;         // cost of the last recompute
+    std::string value;
+};
+
+static const char CACHE_ENTRY_MARK = '\x1e';
+
+inline long long wall_clock_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline std::string encode_cache_entry(const CacheEntry& e) {
+    if (e.fresh_until_ms <= 0 && e.expires_at_ms <= 0 &&
+        (e.value.empty() || e.value[0] != CACHE_ENTRY_MARK)) {
+        return e.value;
+    }
+
+    std::string out;
+    out.reserve(e.value.size() + 48);
+    out += CACHE_ENTRY_MARK;
+    out += std::to_string(e.fresh_until_ms);
+    out += ':';
+    out += std::to_string(e.expires_at_ms);
+    out += ':';
+    out += std::to_string(e.delta_us);
+    out += CACHE_ENTRY_MARK;
+    out += e.value;
+    return out;
+}
+
+inline CacheEntry decode_cache_entry(const char* data, size_t len) {
+    CacheEntry e;
+    if (len > 2 && data[0] == CACHE_ENTRY_MARK) {
+        long long fields[3] = {0, 0, 0};
+        int n = 0;
+        size_t i = 1;
+        bool ok = true;
+        while (ok && n < 3) {
+            size_t digits_start = i;
+            long long v = 0;
+            while (i < len && data[i] >= '0' && data[i] <= '9') {
+                v = v * 10 + (data[i] - '0');
+                i++;
+            }
+            if (i == digits_start || i >= len) { ok = false; break; }
+            fields[n++] = v;
+            if (data[i] == ':') { i++; continue; }
+            break;
+        }
+        if (ok && i < len && data[i] == CACHE_ENTRY_MARK) {
+            e.fresh_until_ms = fields[0];
+            e.expires_at_ms = fields[1];
+            e.delta_us = fields[2];
+            e.value.assign(data + i + 1, len - i - 1);
+            return e;
+        }
+    }
+    e.value.assign(data, len);
+    return e;
+}
+
+inline bool cache_entry_stale(const CacheEntry& e, long long now_ms) {
+    return e.fresh_until_ms > 0 && now_ms >= e.fresh_until_ms;
+}
+
+// XFetch (Vattani et al., "Optimal Probabilistic Cache Stampede Prevention"):
+// refresh when  now - delta * beta * ln(rand())  >= expiry.
+// The expiry is the soft TTL deadline when there is one, otherwise the Redis
+// expiry. Expensive-to-fetch values start refreshing earlier, and because each
+// thread draws its own random number, a hot key is refreshed by one request
+// well before expiry instead of by every handler at the same instant.
+inline bool xfetch_should_refresh(const CacheEntry& e, long long now_ms, double beta) {
+    long long expiry = e.fresh_until_ms > 0 ? e.fresh_until_ms : e.expires_at_ms;
+    if (beta <= 0 || expiry <= 0 || e.delta_us <= 0) return false;
+
+    thread_local std::mt19937_64 rng(std::random_device{}());
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+    double u = 1.0 - uni(rng);  // (0, 1]
+
+    double gap_ms = (e.delta_us / 1000.0) * beta * -std::log(u);
+    return now_ms + gap_ms >= (double)expiry;
+}
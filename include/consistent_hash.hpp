@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// 64-bit FNV-1a. Stable across processes and builds, unlike std::hash, so
+// every server maps a key to the same shard.
+inline uint64_t fnv1a_64(const std::string& s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Jump consistent hash (Lamping & Veach, 2014): maps a key hash to one of
+// `buckets` shards, moving only 1/n of the keys when a shard is appended.
+inline int32_t jump_consistent_hash(uint64_t key, int32_t buckets) {
+    int64_t b = -1, j = 0;
+    while (j < buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (int32_t)b;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// CPU placement helpers for worker pinning. Linux only; elsewhere nothing is
+// pinned and every CPU counts as NUMA node 0.
+
+// Parses a kernel-style CPU list such as "0-3,8,10-11". Returns false on a
+// malformed entry.
+inline bool parse_cpu_list(const std::string& spec, std::vector<int>& out) {
+    out.clear();
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string item = spec.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty()) continue;
+        try {
+            size_t dash = item.find('-');
+            int lo = std::stoi(item.substr(0, dash));
+            int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+            if (lo < 0 || hi < lo) return false;
+            for (int c = lo; c <= hi; c++) out.push_back(c);
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return !out.empty();
+}
+
+// CPUs this process may run on, ascending.
+inline std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+    }
+#endif
+    return cpus;
+}
+
+// NUMA node of every CPU listed under /sys/devices/system/node.
+inline std::map<int, int> cpu_numa_nodes() {
+    std::map<int, int> node_of;
+    for (int node = 0; node < 1024; node++) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!in) {
+            if (node > 0) break;
+            continue;
+        }
+        std::string line;
+        std::getline(in, line);
+        std::vector<int> cpus;
+        if (parse_cpu_list(line, cpus)) {
+            for (int c : cpus) node_of[c] = node;
+        }
+    }
+    return node_of;
+}
+
+// Orders cpus node by node, so consecutive workers share a socket and a
+// pool smaller than the machine stays on as few nodes as possible.
+inline std::vector<int> cpus_by_numa_node(std::vector<int> cpus) {
+    std::map<int, int> node_of = cpu_numa_nodes();
+    auto node = [&](int c) {
+        auto it = node_of.find(c);
+        return it == node_of.end() ? 0 : it->second;
+    };
+    std::stable_sort(cpus.begin(), cpus.end(), [&](int a, int b) { return node(a) < node(b); });
+    return cpus;
+}
+
+// Number of distinct NUMA nodes among cpus.
+inline size_t numa_node_count(const std::vector<int>& cpus) {
+    std::map<int, int> node_of = cpu_numa_nodes();
+    std::vector<int> nodes;
+    for (int c : cpus) {
+        auto it = node_of.find(c);
+        nodes.push_back(it == node_of.end() ? 0 : it->second);
+    }
+    std::sort(nodes.begin(), nodes.end());
+    return std::unique(nodes.begin(), nodes.end()) - nodes.begin();
+}
+
+// Pins the calling thread to one CPU. Memory the thread touches first after
+// this is then placed on that CPU's NUMA node by the kernel's default
+// first-touch policy.
+inline bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
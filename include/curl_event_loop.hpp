@@ -0,0 +1,107 @@
+#pragma once
+#include <curl/curl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <chrono>
+#include <algorithm>
+
+// Runs many curl transfers on one thread: a curl_multi handle driven through
+// curl's socket API and epoll, so each wake-up only touches the connections
+// that are ready instead of polling every transfer as curl_multi_perform
+// does. Linux only (epoll).
+class CurlEventLoop {
+public:
+    // At most max_connections connections are opened (and kept alive);
+    // transfers beyond that wait inside curl for a free one.
+    explicit CurlEventLoop(long max_connections) {
+        epfd = epoll_create1(0);
+        multi = curl_multi_init();
+        curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, &CurlEventLoop::on_socket);
+        curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+        curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, &CurlEventLoop::on_timer);
+        curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+        curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_connections);
+        curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, max_connections);
+    }
+    CurlEventLoop(const CurlEventLoop&) = delete;
+
+    ~CurlEventLoop() {
+        curl_multi_cleanup(multi);
+        close(epfd);
+    }
+
+    bool ok() const { return multi && epfd >= 0; }
+
+    void add(CURL* easy) { curl_multi_add_handle(multi, easy); }
+
+    // Waits up to max_wait_ms for socket activity or curl's own timer, lets
+    // curl make progress, then calls done(easy, result) for every transfer
+    // that finished. A finished handle is already removed from the loop.
+    template<class F>
+    void run_once(int max_wait_ms, F done) {
+        int wait_ms = max_wait_ms;
+        if (timer_armed) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                timer_due - std::chrono::steady_clock::now()).count();
+            wait_ms = (int)std::max<long long>(0, std::min<long long>(wait_ms, left));
+        }
+
+        epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, wait_ms);
+        int running = 0;
+        for (int i = 0; i < n; i++) {
+            int flags = 0;
+            if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(multi, events[i].data.fd, flags, &running);
+        }
+        if (timer_armed && std::chrono::steady_clock::now() >= timer_due) {
+            timer_armed = false;
+            curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+
+        CURLMsg* msg;
+        int left = 0;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL* easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, easy);
+            done(easy, result);
+        }
+    }
+
+private:
+    static int on_socket(CURL*, curl_socket_t s, int what, void* userp, void* socketp) {
+        CurlEventLoop* self = static_cast<CurlEventLoop*>(userp);
+        if (what == CURL_POLL_REMOVE) {
+            epoll_ctl(self->epfd, EPOLL_CTL_DEL, s, nullptr);
+            return 0;
+        }
+        epoll_event ev = {};
+        ev.data.fd = s;
+        if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+        if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+        // socketp marks sockets already registered with epoll.
+        if (socketp) {
+            epoll_ctl(self->epfd, EPOLL_CTL_MOD, s, &ev);
+        } else {
+            epoll_ctl(self->epfd, EPOLL_CTL_ADD, s, &ev);
+            curl_multi_assign(self->multi, s, self);
+        }
+        return 0;
+    }
+
+    static int on_timer(CURLM*, long timeout_ms, void* userp) {
+        CurlEventLoop* self = static_cast<CurlEventLoop*>(userp);
+        self->timer_armed = timeout_ms >= 0;
+        self->timer_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        return 0;
+    }
+
+    int epfd = -1;
+    CURLM* multi = nullptr;
+    bool timer_armed = false;
+    std::chrono::steady_clock::time_point timer_due;
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include <chrono>
+
+// Deadline of the request the calling thread is serving. The server sets it
+// from the X-Deadline-Ms header before routing; the Redis and PostgreSQL
+// backends read it to bound how long a call may block and refuse to start
+// work once it has passed. Threads outside a request (background refreshes,
+// warm-up, snapshotting) have none.
+typedef std::chrono::steady_clock::time_point Deadline;
+
+inline Deadline& current_deadline() {
+    static thread_local Deadline d = Deadline::max();
+    return d;
+}
+
+inline bool has_deadline() { return current_deadline() != Deadline::max(); }
+
+inline bool deadline_expired() {
+    return has_deadline() && std::chrono::steady_clock::now() >= current_deadline();
+}
+
+// Microseconds left before the deadline, 0 once it has passed. Only
+// meaningful when has_deadline().
+inline long long deadline_remaining_us() {
+    auto left = current_deadline() - std::chrono::steady_clock::now();
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(left).count();
+    return us > 0 ? us : 0;
+}
+
+// Replaces the thread's deadline for a scope, e.g. to hand a request's
+// deadline to a helper thread, or to lift it (Deadline::max()) for work
+// that must finish once started, such as invalidating the cache after a
+// committed write.
+class DeadlineScope {
+public:
+    explicit DeadlineScope(Deadline d) : saved(current_deadline()) { current_deadline() = d; }
+    DeadlineScope(const DeadlineScope&) = delete;
+    ~DeadlineScope() { current_deadline() = saved; }
+private:
+    Deadline saved;
+};
@@ -0,0 +1,168 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+// High dynamic range histogram (Gil Tene's HdrHistogram layout): values up
+// to `highest` are kept with `digits` significant decimal digits in
+// log-linear buckets, so recording is a few shifts and an increment and
+// percentiles stay accurate from microseconds to minutes. Not thread-safe:
+// keep one per thread and merge() them at the end.
+class HdrHistogram {
+public:
+    explicit HdrHistogram(int64_t highest = 3600LL * 1000 * 1000, int digits = 3) : highest(highest) {
+        int64_t largest_single_unit = 2 * (int64_t)std::pow(10, digits);
+        int magnitude = (int)std::ceil(std::log2((double)largest_single_unit));
+        sub_bucket_half_magnitude = magnitude - 1;
+        sub_bucket_count = (int64_t)1 << magnitude;
+        sub_bucket_half_count = sub_bucket_count / 2;
+        sub_bucket_mask = sub_bucket_count - 1;
+
+        int64_t smallest_untrackable = sub_bucket_count;
+        bucket_count = 1;
+        while (smallest_untrackable <= highest) {
+            smallest_untrackable <<= 1;
+            bucket_count++;
+        }
+        counts.assign((size_t)((bucket_count + 1) * sub_bucket_half_count), 0);
+    }
+
+    // Values outside [0, highest] are clamped.
+    void record(int64_t v) {
+        v = std::max<int64_t>(0, std::min(v, highest));
+        counts[index_of(v)]++;
+        total++;
+        sum += (double)v;
+        max_value = std::max(max_value, v);
+        min_value = total == 1 ? v : std::min(min_value, v);
+    }
+
+    // o must have been built with the same highest and digits.
+    void merge(const HdrHistogram& o) {
+        if (o.total == 0) return;
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += o.counts[i];
+        min_value = total == 0 ? o.min_value : std::min(min_value, o.min_value);
+        total += o.total;
+        sum += o.sum;
+        max_value = std::max(max_value, o.max_value);
+    }
+
+    int64_t count() const { return total; }
+    int64_t max() const { return max_value; }
+    int64_t min() const { return min_value; }
+    double mean() const { return total ? sum / total : 0; }
+
+    // Smallest recorded value v such that p percent of values are <= v
+    // (within the histogram's precision).
+    int64_t value_at_percentile(double p) const {
+        if (total == 0) return 0;
+        int64_t target = std::max<int64_t>(1, (int64_t)std::ceil(std::min(p, 100.0) / 100 * total));
+        int64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= target) return std::min(highest_equivalent(value_at_index(i)), max_value);
+        }
+        return max_value;
+    }
+
+    // Writes the percentile distribution in HdrHistogram's text (.hgrm)
+    // format, which its plotting tools read. Values are divided by scale.
+    void write_percentiles(std::ostream& out, double scale = 1, int ticks_per_half = 5) const {
+        out << std::setw(12) << "Value" << " " << std::setw(14) << "Percentile" << " "
+            << std::setw(10) << "TotalCount" << " " << std::setw(14) << "1/(1-Percentile)" << "\n\n";
+        out << std::fixed;
+        if (total > 0) {
+            double p = 0;
+            while (p < 100) {
+                int64_t v = value_at_percentile(p);
+                out << std::setprecision(3) << std::setw(12) << v / scale << " "
+                    << std::setprecision(12) << std::setw(14) << p / 100 << " "
+                    << std::setw(10) << count_at_or_below(v) << " "
+                    << std::setprecision(2) << std::setw(14) << 1 / (1 - p / 100) << "\n";
+                // Halve the step each time the remaining tail halves, so the
+                // tail is sampled as finely as the body.
+                double ticks = ticks_per_half * std::pow(2.0, std::floor(std::log2(100 / (100 - p))) + 1);
+                p += 100 / ticks;
+                if (count_at_or_below(v) == total) break;
+            }
+            out << std::setprecision(3) << std::setw(12) << max_value / scale << " "
+                << std::setprecision(12) << std::setw(14) << 1.0 << " " << std::setw(10) << total << "\n";
+        }
+        double var = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (counts[i] == 0) continue;
+            double d = (double)median_equivalent(value_at_index(i)) - mean();
+            var += d * d * counts[i];
+        }
+        out << std::setprecision(3)
+            << "#[Mean    = " << std::setw(12) << mean() / scale
+            << ", StdDeviation   = " << std::setw(12) << (total ? std::sqrt(var / total) : 0) / scale << "]\n"
+            << "#[Max     = " << std::setw(12) << max_value / scale
+            << ", Total count    = " << std::setw(12) << total << "]\n"
+            << "#[Buckets = " << std::setw(12) << bucket_count
+            << ", SubBuckets     = " << std::setw(12) << sub_bucket_count << "]\n";
+        out.unsetf(std::ios::floatfield);
+    }
+
+private:
+    int bucket_index(int64_t v) const {
+        int pow2ceiling = 64 - __builtin_clzll((uint64_t)(v | sub_bucket_mask));
+        return pow2ceiling - (sub_bucket_half_magnitude + 1);
+    }
+
+    size_t index_of(int64_t v) const {
+        int b = bucket_index(v);
+        int64_t sub = v >> b;
+        return (size_t)(((int64_t)(b + 1) << sub_bucket_half_magnitude) + (sub - sub_bucket_half_count));
+    }
+
+    int64_t value_at_index(size_t i) const {
+        int64_t b = ((int64_t)i >> sub_bucket_half_magnitude) - 1;
+        int64_t sub = ((int64_t)i & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+        if (b < 0) {
+            sub -= sub_bucket_half_count;
+            b = 0;
+        }
+        return sub << b;
+    }
+
+    // Width of the bucket holding v: every value in it is recorded alike.
+    int64_t equivalent_range(int64_t v) const {
+        int b = bucket_index(v);
+        int64_t sub = v >> b;
+        return (int64_t)1 << (sub >= sub_bucket_count ? b + 1 : b);
+    }
+
+    int64_t highest_equivalent(int64_t v) const {
+        int b = bucket_index(v);
+        int64_t lowest = (v >> b) << b;
+        return lowest + equivalent_range(v) - 1;
+    }
+
+    int64_t median_equivalent(int64_t v) const {
+        int b = bucket_index(v);
+        return ((v >> b) << b) + equivalent_range(v) / 2;
+    }
+
+    int64_t count_at_or_below(int64_t v) const {
+        size_t last = index_of(std::max<int64_t>(0, std::min(v, highest)));
+        int64_t n = 0;
+        for (size_t i = 0; i <= last; i++) n += counts[i];
+        return n;
+    }
+
+    int64_t highest;
+    int sub_bucket_half_magnitude;
+    int64_t sub_bucket_count;
+    int64_t sub_bucket_half_count;
+    int64_t sub_bucket_mask;
+    int bucket_count;
+    std::vector<int64_t> counts;
+    int64_t total = 0;
+    double sum = 0;
+    int64_t max_value = 0;
+    int64_t min_value = 0;
+};
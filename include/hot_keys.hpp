@@ -0,0 +1,291 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <shared_mutex>
+#include <chrono>
+#include <utility>
+#include <fstream>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Space-Saving heavy-hitters sketch (Metwally et al.) over the GET stream.
+//
+// Tracks at most `capacity` keys. A key not in the sketch replaces the one
+// with the smallest count and inherits that count as its error, so
+// count - error is a guaranteed lower bound on the key's real frequency.
+// Counts are halved every `window_ms` so keys that cool down drop out.
+//
+// Every GET records here, so the sketch is split by key hash into up to
+// STRIPES independent sketches, each with its share of the capacity and
+// its own lock. A key always lands in the same stripe, so its bound holds;
+// top() merges the stripes.
+class HotKeySketch {
+public:
+    struct Item {
+        std::string key;
+        long long count;
+        long long error;
+    };
+
+    static const size_t STRIPES = 16;
+
+    HotKeySketch(size_t capacity, double hot_fraction, long long window_ms)
+        : hot_fraction(hot_fraction), window(window_ms) {
+        size_t n = std::min(capacity, STRIPES);
+        for (size_t i = 0; i < n; i++) {
+            stripes.emplace_back(new Stripe((capacity + n - 1) / n));
+        }
+    }
+
+    // Counts one access to key. Returns true if key is currently hot, i.e.
+    // its guaranteed count is at least hot_fraction of all recorded accesses
+    // (and at least MIN_HOT_COUNT, so nothing is hot right after startup).
+    bool record(const std::string& key) {
+        if (stripes.empty()) return false;
+        Stripe& s = stripe(key);
+        long long guaranteed;
+        {
+            std::lock_guard<std::mutex> lock(s.mu);
+            s.maybe_decay(window);
+            guaranteed = s.record(key);
+        }
+        return guaranteed >= MIN_HOT_COUNT && (double)guaranteed >= hot_fraction * (double)total_recorded();
+    }
+
+    // The n most frequent keys, highest count first.
+    std::vector<Item> top(size_t n) {
+        std::vector<Item> out;
+        for (auto& s : stripes) {
+            std::lock_guard<std::mutex> lock(s->mu);
+            size_t taken = 0;
+            for (auto it = s->by_count.rbegin(); it != s->by_count.rend() && taken < n; ++it, ++taken) {
+                out.push_back(s->slots[it->second]);
+            }
+        }
+        std::sort(out.begin(), out.end(), [](const Item& a, const Item& b) { return a.count > b.count; });
+        if (out.size() > n) out.resize(n);
+        return out;
+    }
+
+    // Restores a key with a previously observed count, e.g. from a snapshot
+    // taken before a restart. Ignored once the key's stripe is full.
+    void seed(const std::string& key, long long count) {
+        if (stripes.empty()) return;
+        Stripe& s = stripe(key);
+        std::lock_guard<std::mutex> lock(s.mu);
+        if (s.slots.size() >= s.capacity || s.index.count(key)) return;
+        size_t slot = s.slots.size();
+        s.slots.push_back({key, count, 0});
+        s.index.emplace(key, slot);
+        s.by_count.insert({count, slot});
+        s.total.store(s.total.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+
+    // Sum of the stripes' totals; each may be read mid-update.
+    long long total_recorded() const {
+        long long t = 0;
+        for (auto& s : stripes) t += s->total.load(std::memory_order_relaxed);
+        return t;
+    }
+
+private:
+    static const long long MIN_HOT_COUNT = 16;
+
+    struct Stripe {
+        explicit Stripe(size_t capacity)
+            : capacity(capacity), last_decay(std::chrono::steady_clock::now()) {
+            slots.reserve(capacity);
+            index.reserve(capacity * 2);
+        }
+
+        // Counts key and returns its guaranteed count. Caller holds mu.
+        long long record(const std::string& key) {
+            total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+            size_t slot;
+            auto it = index.find(key);
+            if (it != index.end()) {
+                slot = it->second;
+                by_count.erase({slots[slot].count, slot});
+                slots[slot].count++;
+            } else if (slots.size() < capacity) {
+                slot = slots.size();
+                slots.push_back({key, 1, 0});
+                index.emplace(key, slot);
+            } else {
+                // Evict the minimum; the newcomer inherits its count as error.
+                auto min_it = by_count.begin();
+                slot = min_it->second;
+                long long min_count = min_it->first;
+                by_count.erase(min_it);
+                index.erase(slots[slot].key);
+                slots[slot] = {key, min_count + 1, min_count};
+                index.emplace(key, slot);
+            }
+            by_count.insert({slots[slot].count, slot});
+            return slots[slot].count - slots[slot].error;
+        }
+
+        // Caller holds mu.
+        void maybe_decay(std::chrono::milliseconds window) {
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_decay < window) return;
+            last_decay = now;
+
+            total.store(total.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+            by_count.clear();
+            for (size_t i = 0; i < slots.size(); i++) {
+                slots[i].count /= 2;
+                slots[i].error /= 2;
+                by_count.insert({slots[i].count, i});
+            }
+        }
+
+        size_t capacity;
+        std::chrono::steady_clock::time_point last_decay;
+        std::mutex mu;
+        // Written under mu, read without it by total_recorded().
+        std::atomic<long long> total{0};
+        std::vector<Item> slots;
+        std::unordered_map<std::string, size_t> index;
+        std::set<std::pair<long long, size_t>> by_count;   // (count, slot), min first
+    };
+
+    Stripe& stripe(const std::string& key) {
+        return *stripes[std::hash<std::string>()(key) % stripes.size()];
+    }
+
+    double hot_fraction;
+    std::chrono::milliseconds window;
+    std::vector<std::unique_ptr<Stripe>> stripes;
+};
+
+// In-process read replica for hot keys. Entries are only valid for a short
+// time so a value written through another server goes stale for at most
+// ttl_ms; writes through this server invalidate immediately.
+class HotKeyReplica {
+public:
+    explicit HotKeyReplica(long long ttl_ms) : ttl(ttl_ms) {}
+
+    bool get(const std::string& key, std::string& val) {
+        std::shared_lock<std::shared_mutex> lock(mu);
+        auto it = entries.find(key);
+        if (it == entries.end() || std::chrono::steady_clock::now() >= it->second.expires) {
+            return false;
+        }
+        val = it->second.value;
+        return true;
+    }
+
+    void put(const std::string& key, const std::string& val) {
+        auto expires = std::chrono::steady_clock::now() + ttl;
+        std::unique_lock<std::shared_mutex> lock(mu);
+        entries[key] = {val, expires};
+    }
+
+    void invalidate(const std::string& key) {
+        std::unique_lock<std::shared_mutex> lock(mu);
+        entries.erase(key);
+    }
+
+    // Drops expired entries so keys that cooled down do not linger.
+    void purge_expired() {
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::shared_mutex> lock(mu);
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (now >= it->second.expires) it = entries.erase(it);
+            else ++it;
+        }
+    }
+
+    bool pinned(const std::string& key) {
+        std::shared_lock<std::shared_mutex> lock(mu);
+        auto it = entries.find(key);
+        return it != entries.end() && std::chrono::steady_clock::now() < it->second.expires;
+    }
+
+    size_t size() {
+        std::shared_lock<std::shared_mutex> lock(mu);
+        return entries.size();
+    }
+
+private:
+    struct Entry {
+        std::string value;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::chrono::milliseconds ttl;
+    std::shared_mutex mu;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+// Access-frequency snapshot file, one key per line, most frequent first:
+//
+//     kvfreq 1
+//     <count> <key-length> <key bytes>
+//
+// The length prefix keeps keys with spaces or newlines intact. The file is
+// written to <path>.tmp, synced and renamed, and the directory is synced
+// after, so a crash never leaves half a snapshot.
+// Longer keys are left out of the snapshot, and a length above this ends
+// the load, since a damaged length would otherwise allocate whatever it says.
+const size_t MAX_SNAPSHOT_KEY_BYTES = 64 * 1024;
+
+inline bool save_freq_snapshot(const std::string& path, const std::vector<HotKeySketch::Item>& items) {
+    std::string data = "kvfreq 1\n";
+    for (auto& item : items) {
+        if (item.key.size() > MAX_SNAPSHOT_KEY_BYTES) continue;
+        data += std::to_string(item.count - item.error) + ' ' + std::to_string(item.key.size()) + ' ';
+        data += item.key;
+        data += '\n';
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t off = 0; ok && off < data.size();) {
+        ssize_t n = ::write(fd, data.data() + off, data.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) off += (size_t)n;
+    }
+    if (ok) ok = fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) return false;
+
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dfd = ::open(dir.c_str(), O_RDONLY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+    return true;
+}
+
+inline std::vector<HotKeySketch::Item> load_freq_snapshot(const std::string& path) {
+    std::vector<HotKeySketch::Item> items;
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int version = 0;
+    if (!(in >> magic >> version) || magic != "kvfreq" || version != 1) return items;
+
+    long long count;
+    size_t len;
+    while (in >> count >> len) {
+        if (len > MAX_SNAPSHOT_KEY_BYTES) break;
+        in.get();   // the space before the key
+        std::string key(len, '\0');
+        if (!in.read(&key[0], (std::streamsize)len)) break;
+        items.push_back({key, count, 0});
+    }
+    return items;
+}
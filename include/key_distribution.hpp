@@ -0,0 +1,141 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdint>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+
+// Walker/Vose alias table: after O(n) setup, draws index i with probability
+// weights[i] / sum(weights) in O(1) (one uniform index, one coin flip).
+class AliasTable {
+public:
+    AliasTable() {}
+
+    explicit AliasTable(const std::vector<double>& weights) {
+        size_t n = weights.size();
+        prob.resize(n);
+        alias.resize(n);
+        double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            scaled[i] = weights[i] * n / total;
+            (scaled[i] < 1 ? small : large).push_back((uint32_t)i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            prob[s] = (float)scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Leftovers are 1 up to rounding.
+        for (uint32_t i : large) { prob[i] = 1; alias[i] = i; }
+        for (uint32_t i : small) { prob[i] = 1; alias[i] = i; }
+    }
+
+    size_t size() const { return prob.size(); }
+
+    template<class Rng>
+    size_t sample(Rng& rng) const {
+        size_t i = std::uniform_int_distribution<size_t>(0, prob.size() - 1)(rng);
+        return std::uniform_real_distribution<float>(0, 1)(rng) < prob[i] ? i : alias[i];
+    }
+
+private:
+    std::vector<float> prob;
+    std::vector<uint32_t> alias;
+};
+
+// Chooses which key of a keyspace [0, keys) a request goes to, as in YCSB's
+// request distributions:
+//   uniform            every key alike
+//   zipfian            key i drawn with weight 1/(i+1)^theta; the popular
+//                      keys are the lowest ones
+//   scrambled-zipfian  the same popularity spread over the keyspace by a
+//                      fixed random permutation
+//   hotspot            hot_ops of requests go to the first hot_keys share
+//                      of the keyspace, the rest to the others
+//   latest             zipfian over recency: the newest keys are hottest
+// Everything is precomputed, so sampling is O(1). Built once and shared
+// read-only by all threads, each passing its own random engine.
+class KeyDistribution {
+public:
+    struct Options {
+        std::string kind = "uniform";
+        uint64_t keys = 1000000;
+        double theta = 0.99;
+        double hot_keys = 0.2;
+        double hot_ops = 0.8;
+        uint64_t seed = 1;
+    };
+
+    static bool known(const std::string& kind) {
+        return parse_kind(kind) != UNKNOWN;
+    }
+
+    explicit KeyDistribution(const Options& opts) : opts(opts), kind(parse_kind(opts.kind)) {
+        if (kind == ZIPFIAN || kind == SCRAMBLED_ZIPFIAN || kind == LATEST) {
+            std::vector<double> w(opts.keys);
+            for (uint64_t i = 0; i < opts.keys; i++) w[i] = 1 / std::pow((double)(i + 1), opts.theta);
+            ranks = AliasTable(w);
+        }
+        if (kind == SCRAMBLED_ZIPFIAN) {
+            permutation.resize(opts.keys);
+            std::iota(permutation.begin(), permutation.end(), 0);
+            std::mt19937_64 rng(opts.seed);
+            std::shuffle(permutation.begin(), permutation.end(), rng);
+        }
+        hot_count = std::max<uint64_t>(1, std::min<uint64_t>(opts.keys, (uint64_t)(opts.hot_keys * opts.keys)));
+    }
+
+    // A key index. `existing` is how many keys exist so far; only latest
+    // uses it, counting back from the newest (existing - 1).
+    template<class Rng>
+    uint64_t sample(Rng& rng, uint64_t existing) const {
+        switch (kind) {
+        case ZIPFIAN:
+            return ranks.sample(rng);
+        case SCRAMBLED_ZIPFIAN:
+            return permutation[ranks.sample(rng)];
+        case LATEST: {
+            uint64_t n = std::max<uint64_t>(1, existing);
+            return n - 1 - ranks.sample(rng) % n;
+        }
+        case HOTSPOT: {
+            bool hot = std::uniform_real_distribution<double>(0, 1)(rng) < opts.hot_ops;
+            if (hot || hot_count == opts.keys) {
+                return std::uniform_int_distribution<uint64_t>(0, hot_count - 1)(rng);
+            }
+            return std::uniform_int_distribution<uint64_t>(hot_count, opts.keys - 1)(rng);
+        }
+        default:
+            return std::uniform_int_distribution<uint64_t>(0, opts.keys - 1)(rng);
+        }
+    }
+
+private:
+    enum Kind { UNIFORM, ZIPFIAN, SCRAMBLED_ZIPFIAN, HOTSPOT, LATEST, UNKNOWN };
+
+    static Kind parse_kind(const std::string& kind) {
+        if (kind == "uniform") return UNIFORM;
+        if (kind == "zipfian") return ZIPFIAN;
+        if (kind == "scrambled-zipfian") return SCRAMBLED_ZIPFIAN;
+        if (kind == "hotspot") return HOTSPOT;
+        if (kind == "latest") return LATEST;
+        return UNKNOWN;
+    }
+
+    Options opts;
+    // opts.kind, parsed once so sample() does not compare strings.
+    Kind kind;
+    AliasTable ranks;
+    std::vector<uint32_t> permutation;
+    uint64_t hot_count;
+};
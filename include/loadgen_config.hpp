@@ -0,0 +1,236 @@
+#pragma once
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include "key_distribution.hpp"
+
+// Options for ./loadgen: the five positional arguments it always took,
+// followed by optional --name=value flags.
+struct LoadgenConfig {
+    std::string base;
+    std::string mode;
+    int threads = 1;
+    int duration_s = 10;
+    int popular_k = 1;
+    // Closed loop: requests each thread keeps in flight, each on its own
+    // keep-alive connection.
+    int concurrency = 1;
+    // Target aggregate requests per second. 0 runs closed loop: each thread
+    // waits for a response before sending its next request.
+    double rate = 0;
+    // Open-loop inter-arrival times: "fixed" or "poisson".
+    std::string arrival = "fixed";
+    // Open loop: requests one thread may have outstanding at once.
+    int max_inflight = 256;
+    // Open loop: connections per thread. The server gives each keep-alive
+    // connection a worker of its own, so threads * connections should not
+    // exceed its --http-threads; requests beyond this wait for a connection.
+    int connections = 4;
+    // Operation mix as shares of all requests (normalised by their sum). Set
+    // by the mode; the --*-proportion flags override it. Inserts write new
+    // keys past the end of the keyspace; read-modify-write reads a key and
+    // then writes it back. No mode deletes; only --delete-proportion does.
+    double read_proportion = 0;
+    double update_proportion = 0;
+    double insert_proportion = 0;
+    double rmw_proportion = 0;
+    double delete_proportion = 0;
+    // Load phase: write every key of the keyspace once before measuring, in
+    // POST /kv_batch requests of load_batch rows.
+    bool load = false;
+    int load_batch = 500;
+    // Seeds every random stream (requests, arrival times, the scrambled
+    // zipfian permutation), so a run with the same options sends the same
+    // requests; keys and load-phase values depend on nothing else.
+    uint64_t seed = 1;
+    // Sizes of written values (see ValueSizeDistribution): fixed:N,
+    // uniform:MIN:MAX, normal:MEAN:STDDEV or file:PATH. Empty writes the
+    // short "v_<n>" values loadgen has always sent; the ycsb-* presets set
+    // their own size.
+    std::string value_size;
+    // Keys k_0 .. k_<keys-1> (get-popular: popular_0 .. popular_<keys-1>),
+    // and how requests are spread over them (see KeyDistribution).
+    uint64_t keys = 1000000;
+    std::string key_dist = "uniform";
+    double zipf_theta = 0.99;
+    // hotspot: hotspot_ops of requests go to the first hotspot_keys of keys.
+    double hotspot_keys = 0.2;
+    double hotspot_ops = 0.8;
+    // If set, full latency histograms are written to <prefix>.<name>.hgrm.
+    std::string histogram_out;
+};
+
+inline void print_loadgen_usage() {
+    std::cout << "Usage: ./loadgen <base-url> <mode> <threads> <duration-s> <popular-k> [options]\n"
+              << "Modes: put-all, get-all, get-popular, mixed, ycsb-a, ycsb-b, ycsb-c, ycsb-d, ycsb-f\n"
+              << "  --concurrency=N       closed-loop requests in flight per thread (default 1)\n"
+              << "  --rate=R              open loop at R requests/s in total (default 0 = closed loop)\n"
+              << "  --arrival=fixed|poisson  open-loop inter-arrival times (default fixed)\n"
+              << "  --max-inflight=N      open-loop requests outstanding per thread (default 256)\n"
+              << "  --connections=N       open-loop connections per thread (default 4)\n"
+              << "  --read-proportion=F, --update-proportion=F, --insert-proportion=F, --rmw-proportion=F,\n"
+              << "  --delete-proportion=F\n"
+              << "                        operation mix (default set by the mode)\n"
+              << "  --load=0|1            write every key once before measuring (default 1 for ycsb-*)\n"
+              << "  --load-batch=N        rows per load-phase POST /kv_batch (default 500)\n"
+              << "  --seed=N              seed of all random choices (default 1)\n"
+              << "  --keys=N              keyspace size (default 1000000, popular-k for get-popular,\n"
+              << "                        1000 for ycsb-*)\n"
+              << "  --key-dist=NAME       uniform, zipfian, scrambled-zipfian, hotspot, latest\n"
+              << "                        (default uniform; set by ycsb-*)\n"
+              << "  --zipf-theta=T        skew of the zipfian distributions (default 0.99)\n"
+              << "  --hotspot-keys=F      hotspot: share of keys that are hot (default 0.2)\n"
+              << "  --hotspot-ops=F       hotspot: share of requests sent to hot keys (default 0.8)\n"
+              << "  --value-size=SPEC     fixed:N, uniform:MIN:MAX, normal:MEAN:STDDEV or file:PATH\n"
+              << "                        (\"<size> <weight>\" lines; default v_<n> values, fixed:1000 for ycsb-*)\n"
+              << "  --histogram-out=PREFIX  write latency histograms to PREFIX.<name>.hgrm\n";
+}
+
+// Sets the operation mix and, for the YCSB core workloads, the keyspace,
+// key distribution and load phase of cfg.mode. Returns false for an unknown
+// mode.
+inline bool apply_loadgen_mode(LoadgenConfig& cfg) {
+    struct Preset {
+        const char* mode;
+        double read, update, insert, rmw;
+        const char* key_dist;
+    };
+    // Workload E (short range scans) is left out: the server has no range
+    // read to scan with.
+    static const Preset presets[] = {
+        { "put-all",     0,    1,    0,    0,   "" },
+        { "get-all",     1,    0,    0,    0,   "" },
+        { "get-popular", 1,    0,    0,    0,   "" },
+        { "mixed",       2./3, 1./3, 0,    0,   "" },
+        { "ycsb-a",      0.5,  0.5,  0,    0,   "zipfian" },  // update heavy
+        { "ycsb-b",      0.95, 0.05, 0,    0,   "zipfian" },  // read mostly
+        { "ycsb-c",      1,    0,    0,    0,   "zipfian" },  // read only
+        { "ycsb-d",      0.95, 0,    0.05, 0,   "latest" },   // read latest
+        { "ycsb-f",      0.5,  0,    0,    0.5, "zipfian" },  // read-modify-write
+    };
+    for (const Preset& p : presets) {
+        if (cfg.mode != p.mode) continue;
+        cfg.read_proportion = p.read;
+        cfg.update_proportion = p.update;
+        cfg.insert_proportion = p.insert;
+        cfg.rmw_proportion = p.rmw;
+        if (*p.key_dist) {
+            // YCSB's workload files: 1000 records of 10 100-byte fields,
+            // loaded before the run.
+            cfg.key_dist = p.key_dist;
+            cfg.keys = 1000;
+            cfg.value_size = "fixed:1000";
+            cfg.load = true;
+        }
+        if (cfg.mode == "get-popular") cfg.keys = std::max(1, cfg.popular_k);
+        return true;
+    }
+    if (cfg.mode == "ycsb-e") {
+        std::cerr << "ycsb-e needs a range scan endpoint, which the server does not have" << std::endl;
+    } else {
+        std::cerr << "Unknown mode: " << cfg.mode << std::endl;
+    }
+    return false;
+}
+
+// Parses the command line into cfg. Returns false (after printing usage)
+// on missing arguments, an unknown flag or a malformed value.
+inline bool parse_loadgen_args(int argc, char** argv, LoadgenConfig& cfg) {
+    if (argc < 6) {
+        print_loadgen_usage();
+        return false;
+    }
+    try {
+        cfg.base = argv[1];
+        cfg.mode = argv[2];
+        cfg.threads = std::stoi(argv[3]);
+        cfg.duration_s = std::stoi(argv[4]);
+        cfg.popular_k = std::stoi(argv[5]);
+    } catch (const std::exception&) {
+        print_loadgen_usage();
+        return false;
+    }
+    if (!apply_loadgen_mode(cfg)) return false;
+
+    for (int i = 6; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            std::cerr << "Bad argument: " << arg << std::endl;
+            print_loadgen_usage();
+            return false;
+        }
+
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+
+        try {
+            if (name == "concurrency") cfg.concurrency = std::stoi(value);
+            else if (name == "rate") cfg.rate = std::stod(value);
+            else if (name == "arrival") cfg.arrival = value;
+            else if (name == "max-inflight") cfg.max_inflight = std::stoi(value);
+            else if (name == "connections") cfg.connections = std::stoi(value);
+            else if (name == "read-proportion") cfg.read_proportion = std::stod(value);
+            else if (name == "update-proportion") cfg.update_proportion = std::stod(value);
+            else if (name == "insert-proportion") cfg.insert_proportion = std::stod(value);
+            else if (name == "rmw-proportion") cfg.rmw_proportion = std::stod(value);
+            else if (name == "delete-proportion") cfg.delete_proportion = std::stod(value);
+            else if (name == "load") cfg.load = std::stoi(value) != 0;
+            else if (name == "load-batch") cfg.load_batch = std::stoi(value);
+            else if (name == "seed") cfg.seed = std::stoull(value);
+            else if (name == "value-size") cfg.value_size = value;
+            else if (name == "keys") cfg.keys = std::stoull(value);
+            else if (name == "key-dist") cfg.key_dist = value;
+            else if (name == "zipf-theta") cfg.zipf_theta = std::stod(value);
+            else if (name == "hotspot-keys") cfg.hotspot_keys = std::stod(value);
+            else if (name == "hotspot-ops") cfg.hotspot_ops = std::stod(value);
+            else if (name == "histogram-out") cfg.histogram_out = value;
+            else {
+                std::cerr << "Unknown option: --" << name << std::endl;
+                print_loadgen_usage();
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Bad value for --" << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+
+    if (cfg.arrival != "fixed" && cfg.arrival != "poisson") {
+        std::cerr << "Unknown arrival process: " << cfg.arrival << std::endl;
+        return false;
+    }
+    if (cfg.read_proportion < 0 || cfg.update_proportion < 0 || cfg.insert_proportion < 0 ||
+        cfg.rmw_proportion < 0 || cfg.delete_proportion < 0 ||
+        cfg.read_proportion + cfg.update_proportion + cfg.insert_proportion + cfg.rmw_proportion +
+        cfg.delete_proportion <= 0) {
+        std::cerr << "Operation proportions must be non-negative and not all 0" << std::endl;
+        return false;
+    }
+    if (!KeyDistribution::known(cfg.key_dist)) {
+        std::cerr << "Unknown key distribution: " << cfg.key_dist << std::endl;
+        return false;
+    }
+    // The zipfian tables index keys with 32 bits.
+    if (cfg.keys < 1 || cfg.keys > UINT32_MAX) {
+        std::cerr << "--keys must be between 1 and " << UINT32_MAX << std::endl;
+        return false;
+    }
+    if (cfg.zipf_theta <= 0) {
+        std::cerr << "--zipf-theta must be positive" << std::endl;
+        return false;
+    }
+    if (cfg.hotspot_keys < 0 || cfg.hotspot_keys > 1 || cfg.hotspot_ops < 0 || cfg.hotspot_ops > 1) {
+        std::cerr << "--hotspot-keys and --hotspot-ops must be between 0 and 1" << std::endl;
+        return false;
+    }
+    if (cfg.threads < 1) cfg.threads = 1;
+    if (cfg.load_batch < 1) cfg.load_batch = 1;
+    if (cfg.concurrency < 1) cfg.concurrency = 1;
+    if (cfg.rate < 0) cfg.rate = 0;
+    if (cfg.max_inflight < 1) cfg.max_inflight = 1;
+    if (cfg.connections < 1) cfg.connections = 1;
+    return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <string>
+
+// Options of the embedded log engine (--storage=log).
+struct LogStorageOptions {
+    std::string dir = "kvdata";
+    // The active segment is closed and a new one started past this size.
+    long long segment_bytes = 64LL << 20;
+    // fdatasync interval for the active segment; 0 syncs on every write.
+    long long sync_ms = 100;
+    // Closed segments that trigger a compaction (at least 2).
+    int compact_segments = 4;
+};
@@ -0,0 +1,548 @@
+#pragma once
+#include "storage.hpp"
+#include "log_options.hpp"
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// CRC-32 (IEEE 802.3), used to detect torn or corrupt log records.
+inline uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    static uint32_t table[256];
+    static bool init = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)init;
+
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Embedded log-structured storage engine (Bitcask-style).
+//
+// Every write is appended to the active segment file in <dir>; an in-memory
+// hash index maps each live key to the offset of its newest record, so a
+// lookup is one pread. Segments are named seg-<id>.log with ids increasing:
+//
+//     header  : "KVLOG001" | u64 supersedes_from
+//     record  : u32 crc | u8 type | u32 key_len | u32 val_len | key | value
+//
+// Integers are host byte order (the files are local to this machine); crc
+// covers type through value. type is PUT or DEL (a tombstone, no value).
+//
+// Recovery replays the segments in id order and truncates a torn record at
+// the tail of the newest one. A background thread fsyncs the active segment
+// every sync_ms and, once compact_segments segments are closed, rewrites all
+// closed segments' live records into one file that takes the newest closed
+// id and records the oldest id it replaces in supersedes_from. The rename
+// is atomic; if the old files outlive a crash, recovery deletes them because
+// a later file supersedes them.
+class LogStorage : public StorageBackend {
+public:
+    explicit LogStorage(const LogStorageOptions& opts) : opts(opts) {
+        if (this->opts.compact_segments < 2) this->opts.compact_segments = 2;
+    }
+    LogStorage(const LogStorage&) = delete;
+
+    ~LogStorage() override {
+        {
+            std::lock_guard<std::mutex> lock(bg_mu);
+            stopping = true;
+        }
+        bg_cv.notify_all();
+        if (bg_thread.joinable()) bg_thread.join();
+
+        if (active_fd >= 0) fdatasync(active_fd);
+        for (auto& f : fds) close(f.second);
+    }
+
+    bool open() override {
+        ::mkdir(opts.dir.c_str(), 0755);
+        DIR* d = opendir(opts.dir.c_str());
+        if (!d) {
+            std::cerr << "Cannot open log storage directory " << opts.dir << std::endl;
+            return false;
+        }
+
+        std::vector<uint64_t> ids;
+        while (dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            unsigned long long id;
+            char tail[16];
+            if (sscanf(name.c_str(), "seg-%llu.%15s", &id, tail) != 2) continue;
+            if (std::string(tail) == "log") ids.push_back(id);
+            else if (std::string(tail) == "compact" || std::string(tail) == "new") {
+                ::unlink((opts.dir + "/" + name).c_str());
+            }
+        }
+        closedir(d);
+        std::sort(ids.begin(), ids.end());
+
+        // Drop segments that a completed compaction superseded.
+        std::vector<uint64_t> live;
+        for (size_t i = ids.size(); i-- > 0;) {
+            uint64_t from = 0;
+            if (!read_header(ids[i], from)) {
+                // A newest segment shorter than its header was torn while
+                // being created (older versions wrote the header in place).
+                struct stat st;
+                if (i + 1 == ids.size() && ::stat(segment_path(ids[i]).c_str(), &st) == 0 &&
+                    st.st_size < (off_t)SEG_HEADER) {
+                    std::cerr << "Removing torn segment " << segment_path(ids[i]) << std::endl;
+                    ::unlink(segment_path(ids[i]).c_str());
+                    continue;
+                }
+                std::cerr << "Bad log segment header: " << segment_path(ids[i]) << std::endl;
+                return false;
+            }
+            live.push_back(ids[i]);
+            if (from == 0) continue;
+            while (i > 0 && ids[i - 1] >= from) {
+                ::unlink(segment_path(ids[i - 1]).c_str());
+                i--;
+            }
+        }
+        std::reverse(live.begin(), live.end());
+
+        for (size_t i = 0; i < live.size(); i++) {
+            int fd = ::open(segment_path(live[i]).c_str(), O_RDWR);
+            if (fd < 0) return false;
+            fds[live[i]] = fd;
+
+            uint64_t end = scan_segment(fd, [&](uint64_t off, uint8_t type, const std::string& key,
+                                                         const char*, uint32_t vlen) {
+                if (type == REC_PUT) index[key] = { live[i], off, (uint32_t)key.size(), vlen };
+                else index.erase(key);
+                return true;
+            });
+            off_t size = lseek(fd, 0, SEEK_END);
+            if ((off_t)end < size) {
+                if (i + 1 == live.size()) {
+                    std::cerr << "Truncating torn tail of " << segment_path(live[i]) << " at " << end << std::endl;
+                    if (ftruncate(fd, (off_t)end) != 0) return false;
+                } else {
+                    std::cerr << "Corrupt record in " << segment_path(live[i]) << " at " << end
+                              << ", ignoring the rest of the segment" << std::endl;
+                }
+            }
+        }
+
+        if (!start_segment(live.empty() ? 1 : live.back() + 1)) return false;
+        bg_thread = std::thread([this]() { background(); });
+        return true;
+    }
+
+    std::string describe() const override {
+        return "log storage " + opts.dir + " (" + std::to_string(index.size()) + " keys)";
+    }
+
+    int lookup(const std::string& key, std::string& val) override {
+        std::shared_lock<std::shared_mutex> lock(index_mu);
+        auto it = index.find(key);
+        if (it == index.end()) return 0;
+        const Loc& loc = it->second;
+        auto fd = fds.find(loc.seg);
+        if (fd == fds.end()) return -1;
+        val.resize(loc.vlen);
+        ssize_t n = pread(fd->second, &val[0], loc.vlen, (off_t)(loc.offset + REC_HEADER + loc.klen));
+        return n == (ssize_t)loc.vlen ? 1 : -1;
+    }
+
+    bool put(const std::string& key, const std::string& val) override {
+        std::string buf;
+        encode_record(buf, REC_PUT, key, val);
+        std::lock_guard<std::mutex> lock(write_mu);
+        uint64_t off;
+        if (!append(buf, off)) return false;
+        {
+            std::unique_lock<std::shared_mutex> ilock(index_mu);
+            index[key] = { active_id, off, (uint32_t)key.size(), (uint32_t)val.size() };
+        }
+        maybe_roll();
+        return true;
+    }
+
+    bool del(const std::string& key) override {
+        std::string buf;
+        encode_record(buf, REC_DEL, key, std::string());
+        std::lock_guard<std::mutex> lock(write_mu);
+        {
+            std::shared_lock<std::shared_mutex> ilock(index_mu);
+            if (!index.count(key)) return true;
+        }
+        uint64_t off;
+        if (!append(buf, off)) return false;
+        {
+            std::unique_lock<std::shared_mutex> ilock(index_mu);
+            index.erase(key);
+        }
+        maybe_roll();
+        return true;
+    }
+
+    Rows get_batch(const std::vector<std::string>& keys) override {
+        Rows out;
+        std::string val;
+        for (auto& k : keys) {
+            if (get(k, val)) out.emplace_back(k, val);
+        }
+        return out;
+    }
+
+    // All rows go out in a single write.
+    bool put_batch(const Rows& rows) override {
+        std::string buf;
+        std::vector<uint64_t> offsets;
+        for (auto& r : rows) {
+            offsets.push_back(buf.size());
+            encode_record(buf, REC_PUT, r.first, r.second);
+        }
+
+        std::lock_guard<std::mutex> lock(write_mu);
+        uint64_t base;
+        if (!append(buf, base)) return false;
+        {
+            std::unique_lock<std::shared_mutex> ilock(index_mu);
+            for (size_t i = 0; i < rows.size(); i++) {
+                index[rows[i].first] = { active_id, base + offsets[i],
+                                         (uint32_t)rows[i].first.size(), (uint32_t)rows[i].second.size() };
+            }
+        }
+        maybe_roll();
+        return true;
+    }
+
+    // Newest segment first; records within a segment in write order.
+    void scan_recent(long long limit, size_t batch,
+                     const std::function<void(const Rows&)>& fn) override {
+        std::vector<std::pair<uint64_t, int>> segs;
+        {
+            std::shared_lock<std::shared_mutex> lock(index_mu);
+            for (auto it = fds.rbegin(); it != fds.rend(); ++it) segs.emplace_back(it->first, dup(it->second));
+        }
+
+        Rows rows;
+        long long produced = 0;
+        for (auto& s : segs) {
+            if (produced < limit) {
+                scan_segment(s.second, [&](uint64_t off, uint8_t type, const std::string& key,
+                                                    const char* val, uint32_t vlen) {
+                    if (type != REC_PUT || !is_live(key, s.first, off)) return true;
+                    rows.emplace_back(key, std::string(val, vlen));
+                    produced++;
+                    if (rows.size() >= batch) {
+                        fn(rows);
+                        rows.clear();
+                    }
+                    return produced < limit;
+                });
+            }
+            close(s.second);
+        }
+        if (!rows.empty()) fn(rows);
+    }
+
+private:
+    static const uint8_t REC_PUT = 1;
+    static const uint8_t REC_DEL = 2;
+    static const size_t REC_HEADER = 13;   // crc + type + key_len + val_len
+    static const size_t SEG_HEADER = 16;   // magic + supersedes_from
+    static const uint64_t MAX_RECORD = 1ULL << 30;   // larger lengths mean corruption
+
+    struct Loc {
+        uint64_t seg;
+        uint64_t offset;   // start of the record
+        uint32_t klen;
+        uint32_t vlen;
+    };
+
+    std::string segment_path(uint64_t id) const {
+        char name[40];
+        snprintf(name, sizeof(name), "/seg-%016llu.log", (unsigned long long)id);
+        return opts.dir + name;
+    }
+
+    static void encode_record(std::string& out, uint8_t type, const std::string& key, const std::string& val) {
+        uint32_t klen = (uint32_t)key.size(), vlen = (uint32_t)val.size();
+        size_t start = out.size();
+        out.resize(start + REC_HEADER);
+        char* h = &out[start];
+        h[4] = (char)type;
+        memcpy(h + 5, &klen, 4);
+        memcpy(h + 9, &vlen, 4);
+        out += key;
+        out += val;
+        uint32_t crc = crc32_update(0, out.data() + start + 4, out.size() - start - 4);
+        memcpy(&out[start], &crc, 4);
+    }
+
+    bool read_header(uint64_t id, uint64_t& supersedes_from) {
+        int fd = ::open(segment_path(id).c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        char h[SEG_HEADER];
+        bool ok = pread(fd, h, SEG_HEADER, 0) == (ssize_t)SEG_HEADER && memcmp(h, "KVLOG001", 8) == 0;
+        if (ok) memcpy(&supersedes_from, h + 8, 8);
+        close(fd);
+        return ok;
+    }
+
+    static bool write_header(int fd, uint64_t supersedes_from) {
+        char h[SEG_HEADER];
+        memcpy(h, "KVLOG001", 8);
+        memcpy(h + 8, &supersedes_from, 8);
+        return pwrite(fd, h, SEG_HEADER, 0) == (ssize_t)SEG_HEADER;
+    }
+
+    // Calls fn(offset, type, key, value, value_len) for every valid record
+    // until fn returns false or a torn/corrupt record is found. Returns the
+    // offset just past the last valid record.
+    template<class F>
+    static uint64_t scan_segment(int fd, F fn) {
+        std::vector<char> buf(1 << 20);
+        uint64_t file_off = SEG_HEADER;    // file offset of buf[0]
+        size_t have = 0, pos = 0;
+        std::string key;
+
+        for (;;) {
+            // Make sure buf holds a whole record starting at pos.
+            auto fill = [&](size_t need) {
+                if (pos + need <= have) return true;
+                memmove(buf.data(), buf.data() + pos, have - pos);
+                file_off += pos;
+                have -= pos;
+                pos = 0;
+                if (need > buf.size()) buf.resize(need);
+                while (have < need) {
+                    ssize_t n = pread(fd, buf.data() + have, buf.size() - have, (off_t)(file_off + have));
+                    if (n <= 0) return false;
+                    have += (size_t)n;
+                }
+                return true;
+            };
+
+            if (!fill(REC_HEADER)) break;
+            uint32_t crc, klen, vlen;
+            uint8_t type = (uint8_t)buf[pos + 4];
+            memcpy(&crc, &buf[pos], 4);
+            memcpy(&klen, &buf[pos + 5], 4);
+            memcpy(&vlen, &buf[pos + 9], 4);
+            if (type != REC_PUT && type != REC_DEL) break;
+            if ((uint64_t)klen + vlen > MAX_RECORD) break;
+            if (!fill(REC_HEADER + klen + vlen)) break;
+            if (crc32_update(0, &buf[pos + 4], REC_HEADER - 4 + klen + vlen) != crc) break;
+
+            uint64_t rec_off = file_off + pos;
+            key.assign(&buf[pos + REC_HEADER], klen);
+            bool more = fn(rec_off, type, key, &buf[pos + REC_HEADER + klen], vlen);
+            pos += REC_HEADER + klen + vlen;
+            if (!more) break;
+        }
+        return file_off + pos;
+    }
+
+    bool is_live(const std::string& key, uint64_t seg, uint64_t off) {
+        std::shared_lock<std::shared_mutex> lock(index_mu);
+        auto it = index.find(key);
+        return it != index.end() && it->second.seg == seg && it->second.offset == off;
+    }
+
+    // Creates segment id as the active one. Caller holds write_mu (or is open()).
+    // The segment is created under a temporary name and renamed once its
+    // header is on disk, so a crash never leaves a headerless seg-*.log.
+    bool start_segment(uint64_t id) {
+        std::string tmp = opts.dir + "/seg-" + std::to_string(id) + ".new";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && write_header(fd, 0) && fdatasync(fd) == 0 &&
+                  ::rename(tmp.c_str(), segment_path(id).c_str()) == 0;
+        if (!ok) {
+            std::cerr << "Cannot create " << segment_path(id) << std::endl;
+            if (fd >= 0) close(fd);
+            ::unlink(tmp.c_str());
+            return false;
+        }
+        int dfd = ::open(opts.dir.c_str(), O_RDONLY);
+        if (dfd >= 0) { fsync(dfd); close(dfd); }
+        std::unique_lock<std::shared_mutex> lock(index_mu);
+        fds[id] = fd;
+        active_id = id;
+        active_fd = fd;
+        active_size = SEG_HEADER;
+        return true;
+    }
+
+    // Appends buf to the active segment. Caller holds write_mu.
+    bool append(const std::string& buf, uint64_t& offset) {
+        size_t done = 0;
+        while (done < buf.size()) {
+            ssize_t n = pwrite(active_fd, buf.data() + done, buf.size() - done, (off_t)(active_size + done));
+            if (n <= 0) return false;
+            done += (size_t)n;
+        }
+        offset = active_size;
+        active_size += buf.size();
+        if (opts.sync_ms == 0) fdatasync(active_fd);
+        return true;
+    }
+
+    // Closes the active segment once it is full. Caller holds write_mu. If
+    // the next segment cannot be created, writes stay in the full one and
+    // the roll is retried after another sixteenth of a segment.
+    void maybe_roll() {
+        if ((long long)active_size < std::max(opts.segment_bytes, roll_retry_size)) return;
+        fdatasync(active_fd);
+        if (!start_segment(active_id + 1)) {
+            roll_retry_size = (long long)active_size + std::max(opts.segment_bytes / 16, 1LL);
+            return;
+        }
+        roll_retry_size = 0;
+        bg_cv.notify_all();
+    }
+
+    void background() {
+        auto period = std::chrono::milliseconds(opts.sync_ms > 0 ? std::min(opts.sync_ms, 1000LL) : 1000);
+        auto next_compact_check = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(bg_mu);
+        while (!stopping) {
+            bg_cv.wait_for(lock, period);
+            if (stopping) break;
+            lock.unlock();
+
+            if (opts.sync_ms > 0) {
+                int fd;
+                {
+                    std::lock_guard<std::mutex> wlock(write_mu);
+                    fd = dup(active_fd);
+                }
+                fdatasync(fd);
+                close(fd);
+            }
+            if (std::chrono::steady_clock::now() >= next_compact_check) {
+                compact();
+                next_compact_check = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            }
+
+            lock.lock();
+        }
+    }
+
+    // Merges every closed segment into one; see the class comment.
+    void compact() {
+        std::vector<std::pair<uint64_t, int>> closed;
+        {
+            std::lock_guard<std::mutex> wlock(write_mu);
+            std::shared_lock<std::shared_mutex> lock(index_mu);
+            for (auto& f : fds) {
+                if (f.first != active_id) closed.emplace_back(f.first, dup(f.second));
+            }
+        }
+        if ((int)closed.size() < opts.compact_segments) {
+            for (auto& c : closed) close(c.second);
+            return;
+        }
+
+        uint64_t from = closed.front().first, to = closed.back().first;
+        std::string tmp = opts.dir + "/seg-" + std::to_string(to) + ".compact";
+        int out = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        bool ok = out >= 0 && write_header(out, from);
+
+        struct Moved { std::string key; Loc from; uint64_t to_off; };
+        std::vector<Moved> moved;
+        std::string buf;
+        uint64_t out_size = SEG_HEADER;
+        auto flush = [&]() {
+            if (ok && !buf.empty()) ok = pwrite(out, buf.data(), buf.size(), (off_t)out_size) == (ssize_t)buf.size();
+            out_size += buf.size();
+            buf.clear();
+        };
+
+        for (auto& c : closed) {
+            if (ok) {
+                scan_segment(c.second, [&](uint64_t off, uint8_t type, const std::string& key,
+                                                    const char* val, uint32_t vlen) {
+                    // Tombstones and overwritten values are dropped: every
+                    // older segment is part of this compaction.
+                    if (type != REC_PUT || !is_live(key, c.first, off)) return true;
+                    moved.push_back({ key, { c.first, off, (uint32_t)key.size(), vlen },
+                                      out_size + buf.size() });
+                    encode_record(buf, REC_PUT, key, std::string(val, vlen));
+                    if (buf.size() >= (1 << 20)) flush();
+                    return true;
+                });
+            }
+            close(c.second);
+        }
+        flush();
+
+        if (ok) ok = fdatasync(out) == 0;
+        if (ok) ok = ::rename(tmp.c_str(), segment_path(to).c_str()) == 0;
+        if (!ok) {
+            if (out >= 0) close(out);
+            ::unlink(tmp.c_str());
+            std::cerr << "Log compaction failed" << std::endl;
+            return;
+        }
+        int dfd = ::open(opts.dir.c_str(), O_RDONLY);
+        if (dfd >= 0) { fsync(dfd); close(dfd); }
+
+        // out stays open as segment `to`, so nothing can fail between the
+        // rename and the index switch.
+        {
+            std::unique_lock<std::shared_mutex> lock(index_mu);
+            for (auto& m : moved) {
+                auto it = index.find(m.key);
+                if (it != index.end() && it->second.seg == m.from.seg && it->second.offset == m.from.offset) {
+                    it->second = { to, m.to_off, m.from.klen, m.from.vlen };
+                }
+            }
+            for (auto& c : closed) {
+                close(fds[c.first]);
+                fds.erase(c.first);
+            }
+            fds[to] = out;
+        }
+        for (auto& c : closed) {
+            if (c.first != to) ::unlink(segment_path(c.first).c_str());
+        }
+        std::cout << "[COMPACT] merged " << closed.size() << " segments, " << moved.size()
+                  << " live keys" << std::endl;
+    }
+
+    LogStorageOptions opts;
+
+    // Lock order: write_mu, then index_mu.
+    std::mutex write_mu;                 // the active segment
+    uint64_t active_id = 0;
+    int active_fd = -1;
+    uint64_t active_size = 0;
+    long long roll_retry_size = 0;       // set after a failed roll
+
+    std::shared_mutex index_mu;          // index and fds
+    std::unordered_map<std::string, Loc> index;
+    std::map<uint64_t, int> fds;         // every segment, by id
+
+    std::thread bg_thread;
+    std::mutex bg_mu;
+    std::condition_variable bg_cv;
+    bool stopping = false;
+};
@@ -0,0 +1,190 @@
+#pragma once
+#include "cache.hpp"
+#include "storage.hpp"
+#include <string>
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+// In-process cache and storage backends. They do no I/O, so running the
+// server with --cache=memory --storage=memory (or --cache=none) measures
+// the HTTP front end on its own; they also make handy test doubles.
+
+// Hash map split into independently locked stripes so handler threads on
+// different keys do not contend.
+template<class V>
+class StripedMap {
+public:
+    static const size_t STRIPES = 64;
+
+    template<class F>
+    auto read(const std::string& key, F fn) {
+        Stripe& s = stripe(key);
+        std::shared_lock<std::shared_mutex> lock(s.mu);
+        auto it = s.map.find(key);
+        return fn(it == s.map.end() ? nullptr : &it->second);
+    }
+
+    template<class F>
+    auto write(const std::string& key, F fn) {
+        Stripe& s = stripe(key);
+        std::unique_lock<std::shared_mutex> lock(s.mu);
+        return fn(s.map, key);
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (auto& s : stripes) {
+            std::shared_lock<std::shared_mutex> lock(s.mu);
+            n += s.map.size();
+        }
+        return n;
+    }
+
+    // Visits entries stripe by stripe until fn returns false.
+    void for_each(const std::function<bool(const std::string&, const V&)>& fn) {
+        for (auto& s : stripes) {
+            std::shared_lock<std::shared_mutex> lock(s.mu);
+            for (auto& e : s.map) {
+                if (!fn(e.first, e.second)) return;
+            }
+        }
+    }
+
+private:
+    struct Stripe {
+        std::shared_mutex mu;
+        std::unordered_map<std::string, V> map;
+    };
+
+    Stripe& stripe(const std::string& key) {
+        return stripes[std::hash<std::string>()(key) % STRIPES];
+    }
+
+    Stripe stripes[STRIPES];
+};
+
+// Cache kept in this process, with lazy expiry. Unbounded: meant for
+// benchmarking and tests, not for production working sets.
+class MemoryCache : public CacheBackend {
+public:
+    bool open() override { return true; }
+    std::string describe() const override { return "in-memory cache"; }
+
+    bool get(const std::string& key, std::string& val) override {
+        auto now = std::chrono::steady_clock::now();
+        return map.read(key, [&](const Entry* e) {
+            if (!e || (e->has_expiry && now >= e->expires)) return false;
+            val = e->value;
+            return true;
+        });
+    }
+
+    void set(const std::string& key, const std::string& val, long long ttl_ms, CacheSetMode mode) override {
+        auto now = std::chrono::steady_clock::now();
+        map.write(key, [&](std::unordered_map<std::string, Entry>& m, const std::string& k) {
+            auto it = m.find(k);
+            bool present = it != m.end() && !(it->second.has_expiry && now >= it->second.expires);
+            if (mode == CacheSetMode::IfExists && !present) return;
+            if (mode == CacheSetMode::IfAbsent && present) return;
+            Entry& e = m[k];
+            e.value = val;
+            e.has_expiry = ttl_ms > 0;
+            e.expires = now + std::chrono::milliseconds(ttl_ms);
+        });
+    }
+
+    void set_batch(const Rows& rows, long long ttl_ms, CacheSetMode mode) override {
+        for (auto& r : rows) set(r.first, r.second, ttl_ms, mode);
+    }
+
+    void del(const std::string& key) override {
+        map.write(key, [](std::unordered_map<std::string, Entry>& m, const std::string& k) { m.erase(k); });
+    }
+
+    int exists(const std::string& key) override {
+        std::string ignored;
+        return get(key, ignored) ? 1 : 0;
+    }
+
+private:
+    struct Entry {
+        std::string value;
+        bool has_expiry = false;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    StripedMap<Entry> map;
+};
+
+// No cache at all: every GET goes to storage.
+class NullCache : public CacheBackend {
+public:
+    bool open() override { return true; }
+    std::string describe() const override { return "null cache (caching disabled)"; }
+    bool get(const std::string&, std::string&) override { return false; }
+    void set(const std::string&, const std::string&, long long, CacheSetMode) override {}
+    void set_batch(const Rows&, long long, CacheSetMode) override {}
+    void del(const std::string&) override {}
+    int exists(const std::string&) override { return 0; }
+};
+
+// Volatile storage kept in this process; contents are lost on exit.
+class MemoryStorage : public StorageBackend {
+public:
+    bool open() override { return true; }
+    std::string describe() const override { return "in-memory storage"; }
+
+    int lookup(const std::string& key, std::string& val) override {
+        return map.read(key, [&](const std::string* v) {
+            if (!v) return 0;
+            val = *v;
+            return 1;
+        });
+    }
+
+    bool put(const std::string& key, const std::string& val) override {
+        map.write(key, [&](std::unordered_map<std::string, std::string>& m, const std::string& k) { m[k] = val; });
+        return true;
+    }
+
+    bool del(const std::string& key) override {
+        map.write(key, [](std::unordered_map<std::string, std::string>& m, const std::string& k) { m.erase(k); });
+        return true;
+    }
+
+    Rows get_batch(const std::vector<std::string>& keys) override {
+        Rows out;
+        std::string val;
+        for (auto& k : keys) {
+            if (get(k, val)) out.emplace_back(k, val);
+        }
+        return out;
+    }
+
+    bool put_batch(const Rows& rows) override {
+        for (auto& r : rows) put(r.first, r.second);
+        return true;
+    }
+
+    // No write order is kept, so this yields arbitrary rows. They are
+    // copied out first so fn runs without holding any stripe lock.
+    void scan_recent(long long limit, size_t batch,
+                     const std::function<void(const Rows&)>& fn) override {
+        Rows all;
+        map.for_each([&](const std::string& k, const std::string& v) {
+            if ((long long)all.size() >= limit) return false;
+            all.emplace_back(k, v);
+            return true;
+        });
+        for (size_t i = 0; i < all.size(); i += batch) {
+            fn(Rows(all.begin() + i, all.begin() + std::min(all.size(), i + batch)));
+        }
+    }
+
+private:
+    StripedMap<std::string> map;
+};
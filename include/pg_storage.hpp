@@ -0,0 +1,507 @@
+#pragma once
+#include "consistent_hash.hpp"
+#include "storage.hpp"
+#include "deadline.hpp"
+#include <libpq-fe.h>
+#include <poll.h>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <utility>
+#include <iostream>
+
+// Fixed set of connections to one PostgreSQL instance.
+class PgPool {
+public:
+    // RAII handle for a borrowed connection.
+    class Lease {
+    public:
+        Lease(PgPool& pool, PGconn* conn) : pool(&pool), conn(conn) {}
+        Lease(Lease&& o) noexcept : pool(o.pool), conn(o.conn) { o.conn = nullptr; }
+        Lease(const Lease&) = delete;
+        ~Lease() { if (conn) pool->release(conn); }
+        PGconn* get() const { return conn; }
+    private:
+        PgPool* pool;
+        PGconn* conn;
+    };
+
+    PgPool(const std::string& conninfo, size_t size) : conninfo(conninfo), size(size) {}
+    PgPool(const PgPool&) = delete;
+
+    ~PgPool() {
+        for (PGconn* c : idle) PQfinish(c);
+    }
+
+    bool connect() {
+        for (size_t i = 0; i < size; i++) {
+            PGconn* c = PQconnectdb(conninfo.c_str());
+            if (PQstatus(c) != CONNECTION_OK) {
+                PQfinish(c);
+                return false;
+            }
+            idle.push_back(c);
+        }
+        return true;
+    }
+
+    // Waits for an idle connection, but not past the thread's request
+    // deadline; the lease is then empty (get() == nullptr).
+    Lease acquire() {
+        if (deadline_expired()) return Lease(*this, nullptr);
+        std::unique_lock<std::mutex> lock(mu);
+        auto available = [this]() { return !idle.empty(); };
+        if (!has_deadline()) {
+            cv.wait(lock, available);
+        } else if (!cv.wait_until(lock, current_deadline(), available)) {
+            return Lease(*this, nullptr);
+        }
+        PGconn* c = idle.back();
+        idle.pop_back();
+        return Lease(*this, c);
+    }
+
+    const std::string& where() const { return conninfo; }
+
+private:
+    void release(PGconn* c) {
+        if (PQstatus(c) != CONNECTION_OK) PQreset(c);
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            idle.push_back(c);
+        }
+        cv.notify_one();
+    }
+
+    std::string conninfo;
+    size_t size;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<PGconn*> idle;
+};
+
+// Sends a statement without waiting for it. False for an empty lease, a
+// deadline that has already passed, or a send error; otherwise collect the
+// result with pg_wait_result.
+inline bool pg_send_params(PGconn* conn, const char* sql, int n, const char* const* params) {
+    return conn && !deadline_expired() && PQsendQueryParams(conn, sql, n, NULL, params, NULL, NULL, 0);
+}
+
+// Waits for the statement sent on conn, cancelling it with PQcancel if the
+// thread's request deadline passes before it completes (the server then
+// rolls it back and reports the cancel).
+inline PGresult* pg_wait_result(PGconn* conn) {
+    bool cancelled = !has_deadline();
+    while (PQisBusy(conn)) {
+        int timeout_ms = -1;
+        if (!cancelled) {
+            long long left_us = deadline_remaining_us();
+            if (left_us == 0) {
+                PGcancel* cancel = PQgetCancel(conn);
+                char err[256];
+                if (cancel) {
+                    PQcancel(cancel, err, sizeof(err));
+                    PQfreeCancel(cancel);
+                }
+                cancelled = true;
+                continue;
+            }
+            timeout_ms = (int)((left_us + 999) / 1000);
+        }
+        pollfd pfd = { PQsocket(conn), POLLIN, 0 };
+        if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) break;
+        if (!PQconsumeInput(conn)) break;
+    }
+
+    // The last result is the statement's own; anything before it is noise.
+    PGresult* last = nullptr;
+    while (PGresult* r = PQgetResult(conn)) {
+        if (last) PQclear(last);
+        last = r;
+    }
+    return last;
+}
+
+// PQexecParams bounded by the thread's request deadline, as pg_wait_result
+// describes. Returns nullptr, which libpq reports as PGRES_FATAL_ERROR, for
+// an empty lease or a deadline that has already passed.
+inline PGresult* pg_exec_params(PGconn* conn, const char* sql, int n, const char* const* params) {
+    if (!conn || deadline_expired()) return nullptr;
+    if (!has_deadline()) return PQexecParams(conn, sql, n, NULL, params, NULL, NULL, 0);
+    if (!pg_send_params(conn, sql, n, params)) return nullptr;
+    return pg_wait_result(conn);
+}
+
+// Builds a text[] literal such as {"a","b\"c"} for an ANY($1) / unnest($1)
+// parameter.
+inline std::string pg_text_array(const std::vector<std::string>& items) {
+    std::string out = "{";
+    for (size_t i = 0; i < items.size(); i++) {
+        if (i > 0) out += ',';
+        out += '"';
+        for (char c : items[i]) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        out += '"';
+    }
+    out += '}';
+    return out;
+}
+
+// Keys this server wrote within the last `window`. Reads of those keys go
+// to the primary so a client always sees its own write even if the
+// replicas lag behind.
+class RecentWrites {
+public:
+    explicit RecentWrites(long long window_ms) : window(window_ms) {}
+
+    void note(const std::string& key) {
+        if (window.count() <= 0) return;
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mu);
+        expire(now);
+        written[key] = now;
+        order.emplace_back(now, key);
+    }
+
+    bool contains(const std::string& key) {
+        if (window.count() <= 0) return false;
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = written.find(key);
+        return it != written.end() && now - it->second < window;
+    }
+
+private:
+    void expire(std::chrono::steady_clock::time_point now) {
+        while (!order.empty() && now - order.front().first >= window) {
+            auto it = written.find(order.front().second);
+            if (it != written.end() && it->second == order.front().first) written.erase(it);
+            order.pop_front();
+        }
+    }
+
+    std::chrono::milliseconds window;
+    std::mutex mu;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> written;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> order;
+};
+
+// One partition of the kv table: a primary that takes every write, plus
+// optional read replicas for lookups.
+struct PgShard {
+    std::unique_ptr<PgPool> primary;
+    std::vector<std::unique_ptr<PgPool>> replicas;
+    // Queries currently running on each replica, for least-outstanding routing.
+    std::unique_ptr<std::atomic<int>[]> outstanding;
+};
+
+// The storage layer: the kv table hash-partitioned over N PostgreSQL
+// instances with jump hash, each behind its own connection pool. Single-key
+// operations go to the owning shard; batches are split per shard and the
+// per-shard statements are all in flight at once. Lookups prefer the
+// shard's replica with the fewest queries in flight, except for keys this
+// server wrote within the read-your-writes window, and fall back to the
+// primary if the replica query fails.
+class PgRouter : public StorageBackend {
+public:
+    // replicas[i] lists the read replicas of conninfos[i] (may be shorter).
+    PgRouter(const std::vector<std::string>& conninfos,
+             const std::vector<std::vector<std::string>>& replicas,
+             size_t pool_size, long long ryw_window_ms)
+        : recent(ryw_window_ms) {
+        for (size_t i = 0; i < conninfos.size(); i++) {
+            PgShard s;
+            s.primary.reset(new PgPool(conninfos[i], pool_size));
+            if (i < replicas.size()) {
+                for (auto& ci : replicas[i]) s.replicas.emplace_back(new PgPool(ci, pool_size));
+            }
+            s.outstanding.reset(new std::atomic<int>[s.replicas.size()]());
+            shards.push_back(std::move(s));
+        }
+    }
+    PgRouter(const PgRouter&) = delete;
+
+    bool open() override {
+        for (auto& s : shards) {
+            if (!connect_pool(*s.primary)) return false;
+            for (auto& p : s.replicas) {
+                if (!connect_pool(*p)) return false;
+            }
+        }
+        return true;
+    }
+
+    std::string describe() const override {
+        size_t replicas = 0;
+        for (auto& s : shards) replicas += s.replicas.size();
+        std::string out = "PostgreSQL (" + std::to_string(shards.size()) +
+                          (shards.size() == 1 ? " shard" : " shards");
+        if (replicas > 0) out += ", " + std::to_string(replicas) + " replicas";
+        return out + ")";
+    }
+
+    size_t shard_of(const std::string& key) const {
+        if (shards.size() == 1) return 0;
+        return (size_t)jump_consistent_hash(fnv1a_64(key), (int32_t)shards.size());
+    }
+
+    int lookup(const std::string& key, std::string& val) override {
+        const char* params[1] = { key.c_str() };
+        PGresult* r = read(shard_of(key), !recent.contains(key), [&](PGconn* c) {
+            return pg_exec_params(c, "SELECT v FROM kv WHERE k=$1", 1, params);
+        });
+        int found = PQresultStatus(r) != PGRES_TUPLES_OK ? -1 : PQntuples(r) > 0 ? 1 : 0;
+        if (found > 0) val.assign(PQgetvalue(r, 0, 0), PQgetlength(r, 0, 0));
+        PQclear(r);
+        return found;
+    }
+
+    bool put(const std::string& key, const std::string& val) override {
+        recent.note(key);
+        auto conn = shards[shard_of(key)].primary->acquire();
+        const char* params[2] = { key.c_str(), val.c_str() };
+        PGresult* r = pg_exec_params(conn.get(),
+            "INSERT INTO kv (k, v) VALUES ($1, $2) ON CONFLICT (k) DO UPDATE SET v = EXCLUDED.v",
+            2, params);
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        PQclear(r);
+        return ok;
+    }
+
+    bool del(const std::string& key) override {
+        recent.note(key);
+        auto conn = shards[shard_of(key)].primary->acquire();
+        const char* params[1] = { key.c_str() };
+        PGresult* r = pg_exec_params(conn.get(), "DELETE FROM kv WHERE k=$1", 1, params);
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        PQclear(r);
+        return ok;
+    }
+
+    // One SELECT ... ANY per shard.
+    Rows get_batch(const std::vector<std::string>& keys) override {
+        std::vector<std::vector<std::string>> split(shards.size());
+        std::vector<char> use_replica(shards.size(), 1);
+        for (auto& k : keys) {
+            size_t s = shard_of(k);
+            split[s].push_back(k);
+            if (recent.contains(k)) use_replica[s] = 0;
+        }
+
+        std::vector<std::vector<std::string>> args(shards.size());
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (!split[s].empty()) args[s].push_back(pg_text_array(split[s]));
+        }
+
+        Rows out;
+        fan_out("SELECT k, v FROM kv WHERE k = ANY($1::text[])", args, use_replica, [&](size_t, PGresult* r) {
+            if (PQresultStatus(r) == PGRES_TUPLES_OK) {
+                for (int i = 0; i < PQntuples(r); i++) {
+                    out.emplace_back(std::string(PQgetvalue(r, i, 0), PQgetlength(r, i, 0)),
+                                     std::string(PQgetvalue(r, i, 1), PQgetlength(r, i, 1)));
+                }
+            }
+            return true;
+        });
+        return out;
+    }
+
+    // One multi-row INSERT per shard. Returns false if any shard failed
+    // (shards that succeeded keep their rows). ON CONFLICT rejects duplicate
+    // keys within one statement, so earlier duplicates are dropped here.
+    bool put_batch(const Rows& rows) override {
+        std::vector<std::vector<std::string>> keys(shards.size()), vals(shards.size());
+        std::vector<std::vector<size_t>> idx(shards.size());
+        for (size_t i = 0; i < rows.size(); i++) {
+            idx[shard_of(rows[i].first)].push_back(i);
+            recent.note(rows[i].first);
+        }
+        for (size_t s = 0; s < shards.size(); s++) {
+            std::unordered_set<std::string> seen;
+            for (size_t n = idx[s].size(); n-- > 0;) {
+                const auto& row = rows[idx[s][n]];
+                if (!seen.insert(row.first).second) continue;
+                keys[s].push_back(row.first);
+                vals[s].push_back(row.second);
+            }
+        }
+
+        std::vector<std::vector<std::string>> args(shards.size());
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (keys[s].empty()) continue;
+            args[s].push_back(pg_text_array(keys[s]));
+            args[s].push_back(pg_text_array(vals[s]));
+        }
+
+        return fan_out("INSERT INTO kv (k, v) SELECT * FROM unnest($1::text[], $2::text[]) "
+                       "ON CONFLICT (k) DO UPDATE SET v = EXCLUDED.v",
+                       args, std::vector<char>(shards.size(), 0), [](size_t, PGresult* r) {
+            return PQresultStatus(r) == PGRES_COMMAND_OK;
+        });
+    }
+
+    // Streams the newest rows of each shard (by age(xmin), so no timestamp
+    // column is needed), limit split evenly between shards, through a
+    // server-side cursor on a dedicated connection to the shard's first
+    // replica, or its primary if it has none.
+    void scan_recent(long long limit, size_t batch,
+                     const std::function<void(const Rows&)>& fn) override {
+        long long per_shard = limit / (long long)shards.size();
+        for (size_t i = 0; i < shards.size() && per_shard > 0; i++) {
+            const PgShard& s = shards[i];
+            const std::string& ci = s.replicas.empty() ? s.primary->where() : s.replicas[0]->where();
+            PGconn* conn = PQconnectdb(ci.c_str());
+            if (PQstatus(conn) != CONNECTION_OK) {
+                std::cerr << "PostgreSQL connection failed: " << ci << std::endl;
+                PQfinish(conn);
+                continue;
+            }
+
+            std::string declare = "DECLARE warm NO SCROLL CURSOR FOR "
+                                  "SELECT k, v FROM kv ORDER BY age(xmin) LIMIT " + std::to_string(per_shard);
+            std::string fetch = "FETCH " + std::to_string(batch) + " FROM warm";
+
+            PQclear(PQexec(conn, "BEGIN"));
+            PGresult* r = PQexec(conn, declare.c_str());
+            bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+            PQclear(r);
+
+            Rows rows;
+            while (ok) {
+                r = PQexec(conn, fetch.c_str());
+                ok = PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) > 0;
+                if (ok) {
+                    rows.clear();
+                    for (int j = 0; j < PQntuples(r); j++) {
+                        rows.emplace_back(std::string(PQgetvalue(r, j, 0), PQgetlength(r, j, 0)),
+                                          std::string(PQgetvalue(r, j, 1), PQgetlength(r, j, 1)));
+                    }
+                }
+                PQclear(r);
+                if (ok) fn(rows);
+            }
+
+            PQclear(PQexec(conn, "CLOSE warm"));
+            PQclear(PQexec(conn, "COMMIT"));
+            PQfinish(conn);
+        }
+    }
+
+private:
+    static bool connect_pool(PgPool& p) {
+        if (p.connect()) return true;
+        std::cerr << "PostgreSQL connection failed: " << p.where() << std::endl;
+        return false;
+    }
+
+    // Runs query on the least busy replica of shard (when allowed and there
+    // is one), retrying on the primary if the replica query errors and the
+    // request deadline has not passed. The caller owns the returned result.
+    template<class Q>
+    PGresult* read(size_t shard, bool allow_replica, Q query) {
+        PgShard& s = shards[shard];
+        if (allow_replica && !s.replicas.empty()) {
+            size_t best = pick_replica(s);
+            s.outstanding[best].fetch_add(1, std::memory_order_relaxed);
+            PGresult* r;
+            {
+                auto conn = s.replicas[best]->acquire();
+                r = query(conn.get());
+            }
+            s.outstanding[best].fetch_sub(1, std::memory_order_relaxed);
+
+            ExecStatusType st = PQresultStatus(r);
+            if (st == PGRES_TUPLES_OK || st == PGRES_COMMAND_OK || deadline_expired()) return r;
+            PQclear(r);
+        }
+        auto conn = s.primary->acquire();
+        return query(conn.get());
+    }
+
+    // The replica of s with the fewest queries in flight, starting the scan
+    // at a rotating index so ties spread out. s must have replicas.
+    size_t pick_replica(PgShard& s) {
+        size_t n = s.replicas.size();
+        size_t first = (size_t)(rr.fetch_add(1, std::memory_order_relaxed) % n);
+        size_t best = first;
+        for (size_t i = 1; i < n; i++) {
+            size_t j = (first + i) % n;
+            if (s.outstanding[j].load(std::memory_order_relaxed) <
+                s.outstanding[best].load(std::memory_order_relaxed)) best = j;
+        }
+        return best;
+    }
+
+    // Runs sql with parameters args[s] on every shard s that has any, on a
+    // replica where allow_replica[s] permits, and hands each result to
+    // on_result(s, r), which must not clear it. Every statement is sent
+    // before any result is awaited, so the shards work in parallel without a
+    // thread per shard. Connections are leased in shard order, so concurrent
+    // batches cannot deadlock on each other's pools; failed replica
+    // statements are retried on the primary only once every lease is back,
+    // as read() does. Returns true if every on_result call did.
+    template<class F>
+    bool fan_out(const char* sql, const std::vector<std::vector<std::string>>& args,
+                 const std::vector<char>& allow_replica, F on_result) {
+        struct Sent {
+            size_t shard;
+            int replica;   // -1 for the primary
+            PgPool::Lease conn;
+            bool sent;
+            PGresult* result;
+        };
+        auto params_of = [&](size_t s) {
+            std::vector<const char*> p;
+            for (auto& a : args[s]) p.push_back(a.c_str());
+            return p;
+        };
+
+        std::vector<Sent> sent;
+        sent.reserve(shards.size());
+        for (size_t s = 0; s < shards.size(); s++) {
+            if (args[s].empty()) continue;
+            PgShard& sh = shards[s];
+            int replica = allow_replica[s] && !sh.replicas.empty() ? (int)pick_replica(sh) : -1;
+            if (replica >= 0) sh.outstanding[replica].fetch_add(1, std::memory_order_relaxed);
+            PgPool& pool = replica >= 0 ? *sh.replicas[replica] : *sh.primary;
+            sent.push_back({s, replica, pool.acquire(), false, nullptr});
+            std::vector<const char*> p = params_of(s);
+            sent.back().sent = pg_send_params(sent.back().conn.get(), sql, (int)p.size(), p.data());
+        }
+
+        for (auto& q : sent) {
+            q.result = q.sent ? pg_wait_result(q.conn.get()) : nullptr;
+            PgPool::Lease done(std::move(q.conn));
+            if (q.replica >= 0) shards[q.shard].outstanding[q.replica].fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        bool ok = true;
+        for (auto& q : sent) {
+            PGresult* r = q.result;
+            ExecStatusType st = PQresultStatus(r);
+            if (q.replica >= 0 && st != PGRES_TUPLES_OK && st != PGRES_COMMAND_OK && !deadline_expired()) {
+                PQclear(r);
+                std::vector<const char*> p = params_of(q.shard);
+                auto conn = shards[q.shard].primary->acquire();
+                r = pg_exec_params(conn.get(), sql, (int)p.size(), p.data());
+            }
+            ok = on_result(q.shard, r) && ok;
+            PQclear(r);
+        }
+        return ok;
+    }
+
+    std::vector<PgShard> shards;
+    RecentWrites recent;
+    std::atomic<size_t> rr{0};
+};
@@ -0,0 +1,236 @@
+#pragma once
+#include "redis_endpoint.hpp"
+#include "consistent_hash.hpp"
+#include "cache.hpp"
+#include "deadline.hpp"
+#include <hiredis/hiredis.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstring>
+#include <iostream>
+
+// Fixed set of connections to one Redis instance. Handler threads borrow a
+// connection for one command (or one pipeline) instead of serialising on a
+// single context.
+class RedisPool {
+public:
+    // RAII handle for a borrowed connection.
+    class Lease {
+    public:
+        Lease(RedisPool& pool, redisContext* ctx, bool timed = false) : pool(&pool), ctx(ctx), timed(timed) {}
+        Lease(Lease&& o) noexcept : pool(o.pool), ctx(o.ctx), timed(o.timed) { o.ctx = nullptr; }
+        Lease(const Lease&) = delete;
+        ~Lease() { if (ctx) pool->release(ctx, timed); }
+        redisContext* get() const { return ctx; }
+    private:
+        RedisPool* pool;
+        redisContext* ctx;
+        bool timed;
+    };
+
+    RedisPool(const RedisEndpoint& ep, size_t size) : endpoint(ep), size(size) {}
+    RedisPool(const RedisPool&) = delete;
+
+    ~RedisPool() {
+        for (redisContext* c : idle) redisFree(c);
+    }
+
+    bool connect() {
+        for (size_t i = 0; i < size; i++) {
+            redisContext* c = redisConnect(endpoint.host.c_str(), endpoint.port);
+            if (!c || c->err) {
+                if (c) redisFree(c);
+                return false;
+            }
+            idle.push_back(c);
+        }
+        return true;
+    }
+
+    // Waits for an idle connection, but not past the thread's request
+    // deadline; the lease is then empty (get() == nullptr). Under a
+    // deadline the connection's socket timeout is set to the time left, so
+    // a command that overruns fails instead of blocking.
+    Lease acquire() {
+        if (deadline_expired()) return Lease(*this, nullptr);
+        std::unique_lock<std::mutex> lock(mu);
+        auto available = [this]() { return !idle.empty(); };
+        if (!has_deadline()) {
+            cv.wait(lock, available);
+        } else if (!cv.wait_until(lock, current_deadline(), available)) {
+            return Lease(*this, nullptr);
+        }
+        redisContext* c = idle.back();
+        idle.pop_back();
+        lock.unlock();
+
+        if (!has_deadline()) return Lease(*this, c);
+        long long left_us = std::max(deadline_remaining_us(), 1LL);
+        struct timeval tv = { (time_t)(left_us / 1000000), (suseconds_t)(left_us % 1000000) };
+        redisSetTimeout(c, tv);
+        return Lease(*this, c, true);
+    }
+
+    const RedisEndpoint& where() const { return endpoint; }
+
+private:
+    void release(redisContext* c, bool timed) {
+        // A context that hit an I/O or protocol error (including a deadline
+        // timeout, which leaves a reply unread) is unusable; reconnect it
+        // before handing it out again.
+        if (c->err) redisReconnect(c);
+        if (timed && !c->err) {
+            struct timeval none = { 0, 0 };
+            redisSetTimeout(c, none);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            idle.push_back(c);
+        }
+        cv.notify_one();
+    }
+
+    RedisEndpoint endpoint;
+    size_t size;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<redisContext*> idle;
+};
+
+// Arguments of one SET. Owns the TTL string that argv points into; key and
+// value must outlive it.
+struct RedisSetArgs {
+    std::string ttl;
+    const char* argv[6];
+    size_t argvlen[6];
+    int argc = 0;
+
+    RedisSetArgs(const std::string& key, const std::string& val, long long ttl_ms, CacheSetMode mode) {
+        add("SET", 3);
+        add(key.c_str(), key.size());
+        add(val.c_str(), val.size());
+        if (ttl_ms > 0) {
+            ttl = std::to_string(ttl_ms);
+            add("PX", 2);
+            add(ttl.c_str(), ttl.size());
+        }
+        if (mode == CacheSetMode::IfExists) add("XX", 2);
+        if (mode == CacheSetMode::IfAbsent) add("NX", 2);
+    }
+
+    RedisSetArgs(const RedisSetArgs&) = delete;
+
+private:
+    void add(const char* s, size_t len) {
+        argv[argc] = s;
+        argvlen[argc++] = len;
+    }
+};
+
+// The Redis cache: keys spread over N Redis instances with jump hash, each
+// instance behind its own connection pool.
+class ShardedRedis : public CacheBackend {
+public:
+    ShardedRedis(const std::vector<RedisEndpoint>& endpoints, size_t pool_size) {
+        for (auto& ep : endpoints) shards.emplace_back(new RedisPool(ep, pool_size));
+    }
+    ShardedRedis(const ShardedRedis&) = delete;
+
+    bool open() override {
+        for (auto& p : shards) {
+            if (!p->connect()) {
+                std::cerr << "Redis connection failed: " << p->where().host << ":"
+                          << p->where().port << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string describe() const override {
+        return "Redis (" + std::to_string(shards.size()) + (shards.size() == 1 ? " shard)" : " shards)");
+    }
+
+    size_t shard_of(const std::string& key) const {
+        if (shards.size() == 1) return 0;
+        return (size_t)jump_consistent_hash(fnv1a_64(key), (int32_t)shards.size());
+    }
+
+    bool get(const std::string& key, std::string& val) override {
+        redisReply* r = command(key, "GET %b", key.data(), key.size());
+        bool hit = r && r->type == REDIS_REPLY_STRING;
+        if (hit) val.assign(r->str, r->len);
+        if (r) freeReplyObject(r);
+        return hit;
+    }
+
+    void set(const std::string& key, const std::string& val, long long ttl_ms, CacheSetMode mode) override {
+        RedisSetArgs a(key, val, ttl_ms, mode);
+        redisReply* r = command_argv(key, a.argc, a.argv, a.argvlen);
+        if (r) freeReplyObject(r);
+    }
+
+    // One pipelined round trip per shard.
+    void set_batch(const Rows& rows, long long ttl_ms, CacheSetMode mode) override {
+        std::vector<std::vector<size_t>> by_shard(shards.size());
+        for (size_t i = 0; i < rows.size(); i++) by_shard[shard_of(rows[i].first)].push_back(i);
+
+        for (size_t s = 0; s < by_shard.size(); s++) {
+            if (by_shard[s].empty()) continue;
+            auto conn = shards[s]->acquire();
+            if (!conn.get()) continue;
+            for (size_t i : by_shard[s]) {
+                RedisSetArgs a(rows[i].first, rows[i].second, ttl_ms, mode);
+                redisAppendCommandArgv(conn.get(), a.argc, a.argv, a.argvlen);
+            }
+            for (size_t n = 0; n < by_shard[s].size(); n++) {
+                void* r = nullptr;
+                if (redisGetReply(conn.get(), &r) != REDIS_OK) break;
+                freeReplyObject(r);
+            }
+        }
+    }
+
+    void del(const std::string& key) override {
+        redisReply* r = command(key, "DEL %b", key.data(), key.size());
+        if (r) freeReplyObject(r);
+    }
+
+    int exists(const std::string& key) override {
+        redisReply* r = command(key, "EXISTS %b", key.data(), key.size());
+        if (!r) return -1;
+        // An error reply (e.g. LOADING or MOVED) says nothing about the key.
+        int found = r->type != REDIS_REPLY_INTEGER ? -1 : r->integer > 0 ? 1 : 0;
+        freeReplyObject(r);
+        return found;
+    }
+
+    // Runs one command on the shard that owns key. The caller frees the
+    // reply; nullptr means the connection failed or the request deadline
+    // passed.
+    redisReply* command_argv(const std::string& key, int argc, const char** argv, const size_t* argvlen) {
+        auto conn = shards[shard_of(key)]->acquire();
+        if (!conn.get()) return nullptr;
+        return (redisReply*)redisCommandArgv(conn.get(), argc, argv, argvlen);
+    }
+
+    // printf-style variant, e.g. command(key, "GET %s", key.c_str()).
+    redisReply* command(const std::string& key, const char* format, ...) {
+        auto conn = shards[shard_of(key)]->acquire();
+        if (!conn.get()) return nullptr;
+        va_list ap;
+        va_start(ap, format);
+        void* r = redisvCommand(conn.get(), format, ap);
+        va_end(ap);
+        return (redisReply*)r;
+    }
+
+private:
+    std::vector<std::unique_ptr<RedisPool>> shards;
+};
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+struct RedisEndpoint {
+    std::string host;
+    int port;
+};
+
+// Parses "host:port,host:port,..." into endpoints. Returns false on a
+// malformed entry.
+inline bool parse_redis_endpoints(const std::string& spec, std::vector<RedisEndpoint>& out) {
+    out.clear();
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos) comma = spec.size();
+        std::string item = spec.substr(pos, comma - pos);
+        size_t colon = item.rfind(':');
+        if (item.empty() || colon == std::string::npos || colon == 0) return false;
+        try {
+            out.push_back({ item.substr(0, colon), std::stoi(item.substr(colon + 1)) });
+        } catch (const std::exception&) {
+            return false;
+        }
+        pos = comma + 1;
+    }
+    return !out.empty();
+}
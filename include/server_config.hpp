@@ -0,0 +1,254 @@
+#pragma once
+#include "redis_endpoint.hpp"
+#include "log_options.hpp"
+#include "cpu_topology.hpp"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+
+// Runtime options for ./server, given as --name=value flags.
+// Every option has a default, so a bare ./server behaves like before.
+struct ServerConfig {
+    // Workers serving HTTP connections; 0 = max(8, cores - 1).
+    int http_threads = 0;
+    // Worker pinning: "none", "auto" (allowed CPUs, NUMA node by node) or a
+    // CPU list such as "0-7,16-23".
+    std::string cpus = "none";
+    // SO_REUSEPORT listeners on port 8080, each with its own accept thread.
+    int listeners = 1;
+    // listen() backlog of each listener.
+    int backlog = 1024;
+    // Connections that may wait for an HTTP worker; beyond that they get 503.
+    int http_queue = 1024;
+    // Requests in the storage write path at once; 0 = no cap.
+    int db_write_limit = 0;
+    // Cache misses reading storage at once; 0 = no cap.
+    int db_read_limit = 0;
+    // Starting value of the latency-driven request limit; 0 = off.
+    int adaptive_limit = 0;
+    // Bounds of the adaptive limit; a max of 0 means the HTTP thread count.
+    int adaptive_limit_min = 2;
+    int adaptive_limit_max = 0;
+    // Latency rise over the baseline tolerated before the limit shrinks.
+    double adaptive_tolerance = 1.5;
+    // Cache backend: "redis", "memory" (in-process) or "none".
+    std::string cache = "redis";
+    // Redis shards; keys are spread over them with jump consistent hashing.
+    std::vector<RedisEndpoint> redis_endpoints{ {"127.0.0.1", 6379} };
+    // Connections per Redis shard.
+    int redis_pool_size = 8;
+    // Storage backend: "pg" (PostgreSQL), "log" (embedded log engine) or
+    // "memory" (in-process, volatile).
+    std::string storage = "pg";
+    LogStorageOptions log;
+    // PostgreSQL shards; the kv table is hash-partitioned over them.
+    std::vector<std::string> pg_shards{ "host=127.0.0.1 dbname=kvstore user=kvuser password=kvpass" };
+    // Read replicas of each shard, same order as pg_shards.
+    std::vector<std::vector<std::string>> pg_replicas{ {} };
+    // Connections per PostgreSQL shard (and per replica).
+    int pg_pool_size = 8;
+    // Keys written by this server are read from the primary for this long,
+    // so a client sees its own write despite replica lag.
+    long long replica_safety_ms = 1000;
+    // After this many ms a cached value is stale: it is still served, but a
+    // background refresh from PostgreSQL is scheduled. 0 disables soft TTL.
+    long long soft_ttl_ms = 0;
+    // Redis expiry (PX) applied to every cached value. 0 means no expiry.
+    long long hard_ttl_ms = 0;
+    // XFetch beta: > 1 refreshes hot keys earlier, 0 disables early refresh.
+    double xfetch_beta = 1.0;
+    // Workers reserved for background cache refreshes.
+    int refresh_threads = 2;
+    // Heavy-hitters sketch size; 0 disables hot-key detection.
+    int hot_keys = 64;
+    // A key is hot once it accounts for this share of recent GETs.
+    double hot_fraction = 0.01;
+    // How long a hot key's value is served from the in-process replica.
+    long long hot_ttl_ms = 50;
+    // Sketch counts are halved every window so cooled-down keys drop out.
+    long long hot_window_ms = 10000;
+    // Keys kept in the access-frequency sketch and written to the snapshot;
+    // 0 disables the snapshot.
+    int snapshot_keys = 0;
+    std::string snapshot_file = "kv_freq.snapshot";
+    long long snapshot_interval_ms = 30000;
+    // Rows preloaded into Redis at startup, newest first. 0 skips warm-up.
+    long long warmup_rows = 0;
+    // Rows per cursor FETCH / Redis pipeline.
+    int warmup_batch = 500;
+    // Warm-up rate limit in rows per second; 0 = unlimited.
+    long long warmup_rate = 50000;
+};
+
+inline void print_server_usage() {
+    std::cout << "Usage: ./server [options]\n"
+              << "  --http-threads=N      HTTP worker threads (default max(8, cores - 1))\n"
+              << "  --cpus=none|auto|LIST pin workers to CPUs, e.g. 0-7,16-23 (default none)\n"
+              << "  --listeners=N         SO_REUSEPORT listeners with their own accept loop (default 1)\n"
+              << "  --backlog=N           listen backlog per listener (default 1024)\n"
+              << "  --http-queue=N        connections waiting for a worker before 503 (default 1024)\n"
+              << "  --db-write-limit=N    concurrent storage writes, 0 = no cap (default 0)\n"
+              << "  --db-read-limit=N     concurrent storage reads on cache miss, 0 = no cap (default 0)\n"
+              << "  --adaptive-limit=N    initial latency-driven request limit, 0 = off (default 0)\n"
+              << "  --adaptive-limit-min=N  lower bound of the adaptive limit (default 2)\n"
+              << "  --adaptive-limit-max=N  upper bound, 0 = HTTP threads (default 0)\n"
+              << "  --adaptive-tolerance=F  latency rise tolerated before backing off (default 1.5)\n"
+              << "  --cache=redis|memory|none cache backend (default redis)\n"
+              << "  --redis=HOST:PORT,... Redis shards (default 127.0.0.1:6379)\n"
+              << "  --redis-pool=N        connections per Redis shard (default 8)\n"
+              << "  --storage=pg|log|memory storage backend (default pg)\n"
+              << "  --data-dir=PATH       log engine directory (default kvdata)\n"
+              << "  --log-segment-mb=N    log segment size (default 64)\n"
+              << "  --log-sync-ms=N       log fsync interval, 0 = every write (default 100)\n"
+              << "  --log-compact-segments=N  closed segments that trigger compaction (default 4)\n"
+              << "  --pg=CONNINFO         PostgreSQL shard; repeat to partition kv over several\n"
+              << "  --pg-replica=CONNINFO read replica of the preceding --pg shard; repeatable\n"
+              << "  --replica-safety-ms=N read-your-writes window for replica reads (default 1000)\n"
+              << "  --pg-pool=N           connections per PostgreSQL shard (default 8)\n"
+              << "  --soft-ttl-ms=N       serve stale after N ms and refresh in background (0 = off)\n"
+              << "  --hard-ttl-ms=N       Redis expiry for cached values (0 = none)\n"
+              << "  --xfetch-beta=B       probabilistic early refresh weight (0 = off, default 1)\n"
+              << "  --refresh-threads=N   workers reserved for background refreshes (default 2)\n"
+              << "  --hot-keys=K          hot-key sketch capacity (0 = off, default 64)\n"
+              << "  --hot-fraction=F      share of GETs that makes a key hot (default 0.01)\n"
+              << "  --hot-ttl-ms=N        validity of locally replicated hot keys (default 50)\n"
+              << "  --hot-window-ms=N     sketch decay window (default 10000)\n"
+              << "  --snapshot-keys=N     keys in the persisted frequency snapshot (0 = off, default 0)\n"
+              << "  --snapshot-file=PATH  frequency snapshot file (default kv_freq.snapshot)\n"
+              << "  --snapshot-interval-ms=N  how often the snapshot is written (default 30000)\n"
+              << "  --warmup-rows=N       rows preloaded into Redis at startup (0 = off, default 0)\n"
+              << "  --warmup-batch=N      rows per cursor fetch / pipeline (default 500)\n"
+              << "  --warmup-rate=N       warm-up rows per second (0 = unlimited, default 50000)\n";
+}
+
+// Parses --name=value flags into cfg. Returns false (after printing usage)
+// on an unknown flag or a malformed value.
+inline bool parse_server_args(int argc, char** argv, ServerConfig& cfg) {
+    bool pg_given = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            print_server_usage();
+            return false;
+        }
+
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            std::cerr << "Bad argument: " << arg << std::endl;
+            print_server_usage();
+            return false;
+        }
+
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+
+        try {
+            if (name == "http-threads") cfg.http_threads = std::stoi(value);
+            else if (name == "cpus") cfg.cpus = value;
+            else if (name == "listeners") cfg.listeners = std::stoi(value);
+            else if (name == "backlog") cfg.backlog = std::stoi(value);
+            else if (name == "http-queue") cfg.http_queue = std::stoi(value);
+            else if (name == "db-write-limit") cfg.db_write_limit = std::stoi(value);
+            else if (name == "db-read-limit") cfg.db_read_limit = std::stoi(value);
+            else if (name == "adaptive-limit") cfg.adaptive_limit = std::stoi(value);
+            else if (name == "adaptive-limit-min") cfg.adaptive_limit_min = std::stoi(value);
+            else if (name == "adaptive-limit-max") cfg.adaptive_limit_max = std::stoi(value);
+            else if (name == "adaptive-tolerance") cfg.adaptive_tolerance = std::stod(value);
+            else if (name == "cache") cfg.cache = value;
+            else if (name == "redis") {
+                if (!parse_redis_endpoints(value, cfg.redis_endpoints)) {
+                    std::cerr << "Bad value for --redis: " << value << std::endl;
+                    return false;
+                }
+            }
+            else if (name == "redis-pool") cfg.redis_pool_size = std::stoi(value);
+            else if (name == "storage") cfg.storage = value;
+            else if (name == "data-dir") cfg.log.dir = value;
+            else if (name == "log-segment-mb") {
+                // Clamped before the shift, which would overflow (or, for a
+                // negative count, be undefined) otherwise.
+                long long mb = std::min(std::max(std::stoll(value), 1LL), 1LL << 20);
+                cfg.log.segment_bytes = mb << 20;
+            }
+            else if (name == "log-sync-ms") cfg.log.sync_ms = std::stoll(value);
+            else if (name == "log-compact-segments") cfg.log.compact_segments = std::stoi(value);
+            else if (name == "pg") {
+                if (!pg_given) {
+                    // A replica given so far belongs to the default shard,
+                    // which this --pg replaces.
+                    if (!cfg.pg_replicas.back().empty()) {
+                        std::cerr << "--pg-replica must follow the --pg shard it belongs to" << std::endl;
+                        return false;
+                    }
+                    cfg.pg_shards.clear();
+                    cfg.pg_replicas.clear();
+                }
+                pg_given = true;
+                cfg.pg_shards.push_back(value);
+                cfg.pg_replicas.emplace_back();
+            }
+            else if (name == "pg-replica") cfg.pg_replicas.back().push_back(value);
+            else if (name == "replica-safety-ms") cfg.replica_safety_ms = std::stoll(value);
+            else if (name == "pg-pool") cfg.pg_pool_size = std::stoi(value);
+            else if (name == "soft-ttl-ms") cfg.soft_ttl_ms = std::stoll(value);
+            else if (name == "hard-ttl-ms") cfg.hard_ttl_ms = std::stoll(value);
+            else if (name == "xfetch-beta") cfg.xfetch_beta = std::stod(value);
+            else if (name == "refresh-threads") cfg.refresh_threads = std::stoi(value);
+            else if (name == "hot-keys") cfg.hot_keys = std::stoi(value);
+            else if (name == "hot-fraction") cfg.hot_fraction = std::stod(value);
+            else if (name == "hot-ttl-ms") cfg.hot_ttl_ms = std::stoll(value);
+            else if (name == "hot-window-ms") cfg.hot_window_ms = std::stoll(value);
+            else if (name == "snapshot-keys") cfg.snapshot_keys = std::stoi(value);
+            else if (name == "snapshot-file") cfg.snapshot_file = value;
+            else if (name == "snapshot-interval-ms") cfg.snapshot_interval_ms = std::stoll(value);
+            else if (name == "warmup-rows") cfg.warmup_rows = std::stoll(value);
+            else if (name == "warmup-batch") cfg.warmup_batch = std::stoi(value);
+            else if (name == "warmup-rate") cfg.warmup_rate = std::stoll(value);
+            else {
+                std::cerr << "Unknown option: --" << name << std::endl;
+                print_server_usage();
+                return false;
+            }
+        } catch (const std::exception&) {
+            std::cerr << "Bad value for --" << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+
+    if (cfg.cache != "redis" && cfg.cache != "memory" && cfg.cache != "none") {
+        std::cerr << "Unknown cache backend: " << cfg.cache << std::endl;
+        return false;
+    }
+    std::vector<int> cpu_list;
+    if (cfg.cpus != "none" && cfg.cpus != "auto" && !parse_cpu_list(cfg.cpus, cpu_list)) {
+        std::cerr << "Bad value for --cpus: " << cfg.cpus << std::endl;
+        return false;
+    }
+    if (cfg.storage != "pg" && cfg.storage != "log" && cfg.storage != "memory") {
+        std::cerr << "Unknown storage backend: " << cfg.storage << std::endl;
+        return false;
+    }
+    if (cfg.log.segment_bytes < (1 << 20)) cfg.log.segment_bytes = 1 << 20;
+    if (cfg.http_threads < 0) cfg.http_threads = 0;
+    if (cfg.http_queue < 1) cfg.http_queue = 1;
+    if (cfg.listeners < 1) cfg.listeners = 1;
+    if (cfg.backlog < 1) cfg.backlog = 1;
+    if (cfg.db_write_limit < 0) cfg.db_write_limit = 0;
+    if (cfg.db_read_limit < 0) cfg.db_read_limit = 0;
+    if (cfg.adaptive_limit < 0) cfg.adaptive_limit = 0;
+    if (cfg.adaptive_limit_min < 1) cfg.adaptive_limit_min = 1;
+    if (cfg.adaptive_limit_max < 0) cfg.adaptive_limit_max = 0;
+    if (cfg.adaptive_tolerance < 1) cfg.adaptive_tolerance = 1;
+    if (cfg.redis_pool_size < 1) cfg.redis_pool_size = 1;
+    if (cfg.pg_pool_size < 1) cfg.pg_pool_size = 1;
+    if (cfg.refresh_threads < 1) cfg.refresh_threads = 1;
+    if (cfg.hot_keys < 0) cfg.hot_keys = 0;
+    if (cfg.hot_window_ms < 1) cfg.hot_window_ms = 1;
+    if (cfg.snapshot_keys < 0) cfg.snapshot_keys = 0;
+    if (cfg.snapshot_interval_ms < 1000) cfg.snapshot_interval_ms = 1000;
+    if (cfg.warmup_rows < 0) cfg.warmup_rows = 0;
+    if (cfg.warmup_batch < 1) cfg.warmup_batch = 1;
+    return true;
+}
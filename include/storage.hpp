@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+
+// Durable key->value storage underneath the HTTP handlers. The server talks
+// to the kv data only through this interface, so PostgreSQL and the
+// embedded log engine are interchangeable (--storage=pg|log|memory).
+class StorageBackend {
+public:
+    typedef std::vector<std::pair<std::string, std::string>> Rows;
+
+    virtual ~StorageBackend() = default;
+
+    // Opens connections / files. Prints the reason and returns false on failure.
+    virtual bool open() = 0;
+    // One-line description for the startup banner, e.g. "PostgreSQL (2 shards)".
+    virtual std::string describe() const = 0;
+
+    // 1 (and val) if key exists, 0 if it does not, -1 if storage could not
+    // be reached, so callers can tell a missing row from an outage.
+    virtual int lookup(const std::string& key, std::string& val) = 0;
+    // Returns false if key does not exist (or on an error).
+    bool get(const std::string& key, std::string& val) { return lookup(key, val) > 0; }
+    virtual bool put(const std::string& key, const std::string& val) = 0;
+    virtual bool del(const std::string& key) = 0;
+
+    // The rows that exist among keys, in any order.
+    virtual Rows get_batch(const std::vector<std::string>& keys) = 0;
+    // Upserts every row; the last of duplicate keys wins. On false some of
+    // the rows may still have been written.
+    virtual bool put_batch(const Rows& rows) = 0;
+
+    // Calls fn with batches of at most `batch` rows, most recently written
+    // first where the backend can tell, until `limit` rows have been
+    // produced. Used by the startup warm-up.
+    virtual void scan_recent(long long limit, size_t batch,
+                             const std::function<void(const Rows&)>& fn) = 0;
+};
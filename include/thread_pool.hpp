@@ -1,55 +1,679 @@
 #pragma once
+#include "unique_function.hpp"
+#include "cpu_topology.hpp"
 #include <vector>
 #include <thread>
-#include <queue>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <cstddef>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
+// Chase-Lev work-stealing deque (Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owning worker pushes and pops
+// at the bottom without locks; other workers steal from the top with one CAS.
+// The buffer doubles when full. Retired buffers are kept until destruction
+// because a thief may still be reading one.
+template<class T>
+class WorkStealingDeque {
+public:
+    // capacity must be a power of two.
+    explicit WorkStealingDeque(size_t capacity = 256) {
+        buffers.emplace_back(new Buffer(capacity));
+        array.store(buffers.back().get(), std::memory_order_relaxed);
+    }
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+
+    // Owner only.
+    void push(T x) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Buffer* a = array.load(std::memory_order_relaxed);
+        if (b - t >= (int64_t)a->capacity()) a = grow(a, b, t);
+        a->put(b, x);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only. Takes the most recently pushed item.
+    bool pop(T& out) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        out = a->get(b);
+        if (t == b) {
+            // Last item: race the thieves for it.
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread. Takes the oldest item; false if empty or another thief won.
+    bool steal(T& out) {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+
+        Buffer* a = array.load(std::memory_order_acquire);
+        T x = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            return false;
+        }
+        out = x;
+        return true;
+    }
+
+    // Approximate when called by a thief.
+    bool empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Buffer {
+        size_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+
+        explicit Buffer(size_t capacity) : mask(capacity - 1), slots(new std::atomic<T>[capacity]) {}
+        size_t capacity() const { return mask + 1; }
+        T get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, T x) { slots[i & mask].store(x, std::memory_order_relaxed); }
+    };
+
+    Buffer* grow(Buffer* old, int64_t b, int64_t t) {
+        buffers.emplace_back(new Buffer(old->capacity() * 2));
+        Buffer* a = buffers.back().get();
+        for (int64_t i = t; i < b; i++) a->put(i, old->get(i));
+        array.store(a, std::memory_order_release);
+        return a;
+    }
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Buffer*> array;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+// Bounded MPMC ring buffer (Vyukov). Each cell carries a sequence number
+// saying whether it is free for the producer at that position or filled for
+// the consumer, so producers and consumers only contend on their own
+// position counter and a full queue is detected without a lock.
+template<class T>
+class BoundedMpmcQueue {
+public:
+    // Rounded up to a power of two.
+    explicit BoundedMpmcQueue(size_t capacity) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        mask = cap - 1;
+        cells.reset(new Cell[cap]);
+        for (size_t i = 0; i < cap; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    BoundedMpmcQueue(const BoundedMpmcQueue&) = delete;
+
+    // Returns false if the queue is full. value is only moved from on success.
+    template<class U>
+    bool try_enqueue(U&& value) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell* c;
+        while (true) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = std::forward<U>(value);
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_dequeue(T& out) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Cell* c;
+        while (true) {
+            c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        out = std::move(c->value);
+        c->value = T();
+        c->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // Approximate under concurrency.
+    size_t size() const {
+        size_t e = enqueue_pos.load(std::memory_order_relaxed);
+        size_t d = dequeue_pos.load(std::memory_order_relaxed);
+        return e > d ? e - d : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+// Parks idle workers without putting a lock on the submit path. A worker
+// calls prepare_wait(), looks for work once more, then either cancel_wait()s
+// or wait()s; notify() skips the syscall when nobody is parked.
+class EventCount {
+public:
+    uint32_t prepare_wait() {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_acquire);
+    }
+
+    void cancel_wait() {
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wait(uint32_t key) {
+        while (epoch.load(std::memory_order_acquire) == key) sleep(key);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Call after publishing work (or a state change the waiters check).
+    void notify(bool all) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0) return;
+        epoch.fetch_add(1, std::memory_order_release);
+        wake(all ? INT_MAX : 1);
+    }
+
+private:
+#ifdef __linux__
+    void sleep(uint32_t key) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, key,
+                nullptr, nullptr, 0);
+    }
+    void wake(int n) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, n,
+                nullptr, nullptr, 0);
+    }
+#else
+    void sleep(uint32_t key) {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&]() { return epoch.load(std::memory_order_acquire) != key; });
+    }
+    void wake(int n) {
+        { std::lock_guard<std::mutex> lock(mu); }
+        if (n == 1) cv.notify_one(); else cv.notify_all();
+    }
+    std::mutex mu;
+    std::condition_variable cv;
+#endif
+
+    std::atomic<uint32_t> epoch{0};
+    std::atomic<int> waiters{0};
+};
+
+#ifndef THREAD_POOL_TASK_BYTES
+#define THREAD_POOL_TASK_BYTES 64
+#endif
+
+// Scheduling options of one ThreadPool lane.
+struct LaneOptions {
+    // Share of the picks when several lanes have queued tasks.
+    unsigned weight = 1;
+    // Most tasks of this lane running at once; 0 = no cap.
+    size_t max_running = 0;
+};
+
+// Work-stealing pool. Each worker has its own deque: tasks enqueued from a
+// worker go there (LIFO for the owner, stolen FIFO by others), so workers
+// rarely touch shared state. Tasks from outside the pool, such as httplib's
+// accept loop, go to a bounded lock-free injection queue, which a worker
+// drains a few tasks at a time into its own deque; when it is full,
+// try_enqueue() refuses the task so the caller can shed load instead of
+// queueing without limit. Idle workers steal starting at a random victim,
+// then park on a futex until notified.
+//
+// Tasks are move-only UniqueFunctions holding up to THREAD_POOL_TASK_BYTES
+// of captures inline. The injection queue stores them by value and deque
+// nodes are recycled through per-worker free lists, so once warm, enqueue
+// and dequeue do not allocate.
+//
+// Outside tasks can be split into priority lanes, each with its own
+// injection queue. A worker picks among lanes with queued tasks by smooth
+// weighted round-robin, skipping lanes already at max_running, so
+// background work can be given a small share and a cap on the workers it
+// may hold. The cap is enforced at dispatch: a task of a capped lane takes
+// one of the lane's slots before it leaves the lane's queue (or, enqueued
+// from a worker, before it goes to that worker's deque) and keeps it until
+// it has run. Tasks in the deques therefore count against the cap, and any
+// worker may run whatever it pops or steals. A task whose lane is full
+// waits in the lane's queue.
+//
+// Given a CPU list, worker i is pinned to cpus[i % cpus.size()] and builds
+// its own deque and free lists after pinning, so they are first-touched on
+// that CPU's NUMA node.
 class ThreadPool {
 public:
-    ThreadPool(size_t threads) {
-        for (size_t i = 0; i < threads; i++) {
-            workers.emplace_back([this]() {
-                while (true) {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(mu);
-                        cv.wait(lock, [this]() { return stop || !tasks.empty(); });
-                        if (stop && tasks.empty()) return;
-                        task = std::move(tasks.front());
-                        tasks.pop();
-                    }
+    typedef UniqueFunction<void(), THREAD_POOL_TASK_BYTES> Task;
+
+    // Workers track lanes in a 64-bit mask.
+    static const size_t MAX_LANES = 64;
 
-                    task();
+    // Lane i is the i-th entry of lane_options; entries past MAX_LANES are
+    // ignored.
+    ThreadPool(size_t threads, size_t queue_capacity = 1024,
+               const std::vector<LaneOptions>& lane_options = { LaneOptions() },
+               const std::vector<int>& cpus = {}) {
+        if (threads < 1) threads = 1;
+        for (const LaneOptions& o : lane_options) {
+            if (lanes.size() == MAX_LANES) break;
+            lanes.emplace_back(new Lane(queue_capacity, o));
+        }
+        if (lanes.empty()) lanes.emplace_back(new Lane(queue_capacity, LaneOptions()));
+        locals.resize(threads);
+        for (size_t i = 0; i < threads; i++) {
+            int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+            workers.emplace_back([this, i, cpu]() {
+                if (cpu >= 0) pin_current_thread(cpu);
+                locals[i].reset(new Worker(lanes.size()));
+                // Nobody may steal until every worker's deque exists.
+                {
+                    std::unique_lock<std::mutex> lock(start_mu);
+                    if (++started == locals.size()) start_cv.notify_all();
+                    start_cv.wait(lock, [this]() { return started == locals.size(); });
                 }
+                run(i);
             });
         }
     }
+    ThreadPool(const ThreadPool&) = delete;
 
+    // Returns false, leaving task untouched, if the lane's queue is full or
+    // there is no such lane. Tasks that go to a worker's own deque are
+    // always accepted.
     template<class F>
-    void enqueue(F&& task) {
-        {
-            std::unique_lock<std::mutex> lock(mu);
-            tasks.push(std::forward<F>(task));
+    bool try_enqueue(F&& task, size_t lane = 0) {
+        if (lane >= lanes.size()) return false;
+        Current& cur = current();
+        Lane& l = *lanes[lane];
+        if (cur.pool == this && reserve(l)) {
+            TaskNode* node = alloc_node(cur.index);
+            node->task = std::forward<F>(task);
+            if (l.options.max_running) node->capped_lane = (int)lane;
+            locals[cur.index]->deque.push(node);
+        } else if (!l.queue.try_enqueue(std::forward<F>(task))) {
+            return false;
         }
-        cv.notify_one();
+        parker.notify(false);
+        return true;
+    }
+
+    // Like try_enqueue(), but waits for room instead of failing.
+    template<class F>
+    void enqueue(F&& task, size_t lane = 0) {
+        while (!try_enqueue(std::forward<F>(task), lane)) std::this_thread::yield();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // True when called from one of this pool's workers.
+    bool on_worker_thread() const { return current().pool == this; }
+
+    // Runs every queued task, then joins the workers. Safe to call twice.
+    void shutdown() {
+        if (stop.exchange(true)) return;
+        parker.notify(true);
+        for (std::thread &t : workers) t.join();
     }
 
     ~ThreadPool() {
+        shutdown();
+        delete_nodes(spare_nodes);
+    }
+
+private:
+    // Tasks moved from the injection queue to a worker's deque at once.
+    static constexpr size_t INJECT_BATCH = 16;
+    // Spare nodes a worker keeps before handing a batch to the shared list.
+    static constexpr size_t LOCAL_FREE_NODES = 256;
+    static constexpr size_t NODE_BATCH = 128;
+    // Spare nodes kept in the shared list; beyond this they are freed.
+    static constexpr size_t MAX_SPARE_NODES = 8192;
+
+    struct TaskNode {
+        Task task;
+        TaskNode* next = nullptr;
+        // Lane whose running count this task holds, or -1.
+        int capped_lane = -1;
+    };
+
+    struct Lane {
+        BoundedMpmcQueue<Task> queue;
+        LaneOptions options;
+        std::atomic<size_t> running{0};
+
+        Lane(size_t capacity, const LaneOptions& o) : queue(capacity), options(o) {}
+    };
+
+    struct Worker {
+        WorkStealingDeque<TaskNode*> deque;
+        // Smooth weighted round-robin state, one entry per lane.
+        std::vector<long> credit;
+        // Only touched by the worker's own thread. A node goes back to the
+        // list of whichever worker ran it.
+        TaskNode* free_nodes = nullptr;
+        size_t free_count = 0;
+
+        explicit Worker(size_t lanes) : credit(lanes, 0) {}
+        ~Worker() { delete_nodes(free_nodes); }
+    };
+
+    static void delete_nodes(TaskNode* n) {
+        while (n) {
+            TaskNode* next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    struct Current {
+        ThreadPool* pool;
+        size_t index;
+    };
+
+    static Current& current() {
+        static thread_local Current cur{ nullptr, 0 };
+        return cur;
+    }
+
+    TaskNode* alloc_node(size_t self) {
+        Worker& w = *locals[self];
+        if (!w.free_nodes) {
+            // Refill from the shared list: a worker that mostly enqueues
+            // gets back the nodes freed by the workers that ran its tasks.
+            std::lock_guard<std::mutex> lock(spare_mu);
+            while (spare_nodes && w.free_count < NODE_BATCH) {
+                TaskNode* n = spare_nodes;
+                spare_nodes = n->next;
+                spare_count--;
+                n->next = w.free_nodes;
+                w.free_nodes = n;
+                w.free_count++;
+            }
+        }
+        if (!w.free_nodes) return new TaskNode();
+        TaskNode* n = w.free_nodes;
+        w.free_nodes = n->next;
+        w.free_count--;
+        return n;
+    }
+
+    void free_node(size_t self, TaskNode* n) {
+        n->task = nullptr;
+        n->capped_lane = -1;
+        Worker& w = *locals[self];
+        n->next = w.free_nodes;
+        w.free_nodes = n;
+        if (++w.free_count <= LOCAL_FREE_NODES) return;
+
+        // Hand a batch to the shared list (or free it if that is full).
+        TaskNode* batch = w.free_nodes;
+        TaskNode* last = batch;
+        for (size_t i = 1; i < NODE_BATCH; i++) last = last->next;
+        w.free_nodes = last->next;
+        w.free_count -= NODE_BATCH;
         {
-            std::unique_lock<std::mutex> lock(mu);
-            stop = true;
+            std::lock_guard<std::mutex> lock(spare_mu);
+            if (spare_count < MAX_SPARE_NODES) {
+                last->next = spare_nodes;
+                spare_nodes = batch;
+                spare_count += NODE_BATCH;
+                return;
+            }
         }
-        cv.notify_all();
-        for (std::thread &t : workers) t.join();
+        last->next = nullptr;
+        delete_nodes(batch);
     }
 
-private:
+    void run(size_t self) {
+        current() = { this, self };
+        uint64_t rng = 0x9E3779B97F4A7C15ULL * (self + 1);
+        TaskNode* node;
+
+        while (true) {
+            if (!find_task(self, rng, node)) {
+                uint32_t key = parker.prepare_wait();
+                if (!find_task(self, rng, node)) {
+                    if (stop.load(std::memory_order_acquire)) {
+                        parker.cancel_wait();
+                        return;
+                    }
+                    parker.wait(key);
+                    continue;
+                }
+                parker.cancel_wait();
+            }
+            node->task();
+            if (node->capped_lane >= 0) {
+                Lane& l = *lanes[node->capped_lane];
+                l.running.fetch_sub(1, std::memory_order_release);
+                // A worker may have parked because the lane was full.
+                if (l.queue.size() > 0) parker.notify(false);
+            }
+            free_node(self, node);
+        }
+    }
+
+    bool find_task(size_t self, uint64_t& rng, TaskNode*& out) {
+        if (locals[self]->deque.pop(out)) return true;
+        if (take_injected(self, out)) return true;
+
+        // xorshift64 picks where the sweep starts, so thieves spread out
+        // instead of all hitting worker 0.
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        size_t n = locals.size();
+        size_t start = rng % n;
+        for (size_t i = 0; i < n; i++) {
+            size_t victim = (start + i) % n;
+            if (victim == self) continue;
+            WorkStealingDeque<TaskNode*>& q = locals[victim]->deque;
+            while (!q.empty()) {
+                if (q.steal(out)) {
+                    // More left: wake another worker to help drain it.
+                    if (!q.empty()) parker.notify(false);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool take_injected(size_t self, TaskNode*& out) {
+        Worker& w = *locals[self];
+        uint64_t skip = 0;  // lanes found full or drained during this call
+
+        for (size_t attempt = 0; attempt < lanes.size(); attempt++) {
+            // Smooth weighted round-robin over the lanes with queued tasks
+            // and room to run one more.
+            int best = -1;
+            long total = 0;
+            for (size_t i = 0; i < lanes.size(); i++) {
+                Lane& l = *lanes[i];
+                if ((skip >> i & 1) || l.queue.size() == 0) continue;
+                if (l.options.max_running &&
+                    l.running.load(std::memory_order_acquire) >= l.options.max_running) continue;
+                w.credit[i] += l.options.weight;
+                total += l.options.weight;
+                if (best < 0 || w.credit[i] > w.credit[best]) best = (int)i;
+            }
+            if (best < 0) return false;
+            w.credit[best] -= total;
+
+            Lane& l = *lanes[best];
+            if (!reserve(l)) {
+                skip |= 1ULL << best;
+                continue;
+            }
+            out = alloc_node(self);
+            if (!l.queue.try_dequeue(out->task)) {
+                unreserve(l);
+                free_node(self, out);
+                skip |= 1ULL << best;
+                continue;
+            }
+            if (l.options.max_running) out->capped_lane = best;
+            move_share(self, best);
+            return true;
+        }
+        return false;
+    }
+
+    // Takes a slot of a capped lane; always succeeds for an uncapped one.
+    static bool reserve(Lane& l) {
+        if (!l.options.max_running) return true;
+        if (l.running.fetch_add(1, std::memory_order_acq_rel) < l.options.max_running) return true;
+        l.running.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+
+    static void unreserve(Lane& l) {
+        if (l.options.max_running) l.running.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Moves a fair share of a lane's backlog into this worker's deque, where
+    // idle workers can steal it without touching the shared queue. Each
+    // task moved from a capped lane takes a slot, so the share stops early
+    // once the lane is full.
+    void move_share(size_t self, size_t lane) {
+        Lane& l = *lanes[lane];
+        size_t moved = 0, share = std::min(INJECT_BATCH, l.queue.size() / locals.size());
+        while (moved < share && reserve(l)) {
+            TaskNode* node = alloc_node(self);
+            if (!l.queue.try_dequeue(node->task)) {
+                unreserve(l);
+                free_node(self, node);
+                break;
+            }
+            if (l.options.max_running) node->capped_lane = (int)lane;
+            locals[self]->deque.push(node);
+            moved++;
+        }
+        if (moved > 0) parker.notify(false);
+    }
+
+    std::vector<std::unique_ptr<Worker>> locals;
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    std::vector<std::unique_ptr<Lane>> lanes;
+    EventCount parker;
+    std::atomic<bool> stop{false};
+    std::mutex spare_mu;
+    TaskNode* spare_nodes = nullptr;
+    size_t spare_count = 0;
+    std::mutex start_mu;
+    std::condition_variable start_cv;
+    size_t started = 0;
+};
+
+// Caps how many callers are inside a section at once, e.g. the PG-bound
+// part of a handler, so a burst of slow requests cannot occupy every worker.
+// Up to max_waiting callers queue for a slot; past that acquire() fails at
+// once and the caller should shed the request. limit = 0 means no cap.
+class ConcurrencyLimit {
+public:
+    // RAII slot; false if the limit refused the caller.
+    class Permit {
+    public:
+        explicit Permit(ConcurrencyLimit* owner) : owner(owner) {}
+        Permit(Permit&& o) noexcept : owner(o.owner), granted(o.granted) { o.owner = nullptr; }
+        Permit(const Permit&) = delete;
+        ~Permit() { if (owner && granted) owner->release(); }
+        explicit operator bool() const { return granted; }
+    private:
+        friend class ConcurrencyLimit;
+        ConcurrencyLimit* owner;
+        bool granted = false;
+    };
+
+    ConcurrencyLimit(size_t limit, size_t max_waiting) : limit(limit), max_waiting(max_waiting) {}
+    ConcurrencyLimit(const ConcurrencyLimit&) = delete;
+
+    Permit acquire() {
+        Permit p(this);
+        if (limit == 0) {
+            p.owner = nullptr;
+            p.granted = true;
+            return p;
+        }
+        std::unique_lock<std::mutex> lock(mu);
+        if (running >= limit) {
+            if (waiting >= max_waiting) {
+                rejections++;
+                return p;
+            }
+            waiting++;
+            cv.wait(lock, [this]() { return running < limit; });
+            waiting--;
+        }
+        running++;
+        p.granted = true;
+        return p;
+    }
+
+    // Callers turned away so far.
+    unsigned long long rejected() const { return rejections.load(std::memory_order_relaxed); }
+
+private:
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            running--;
+        }
+        cv.notify_one();
+    }
+
+    size_t limit;
+    size_t max_waiting;
     std::mutex mu;
     std::condition_variable cv;
-    bool stop = false;
+    size_t running = 0;
+    size_t waiting = 0;
+    std::atomic<unsigned long long> rejections{0};
 };
@@ -0,0 +1,123 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only replacement for std::function. Callables of up to InlineBytes
+// (and nothrow-movable) are stored in place, so wrapping a typical lambda
+// does not allocate; larger ones fall back to the heap. Unlike std::function
+// it accepts move-only captures such as a unique_ptr or a PGresult holder.
+template<class Signature, size_t InlineBytes = 64>
+class UniqueFunction;
+
+template<class R, class... Args, size_t InlineBytes>
+class UniqueFunction<R(Args...), InlineBytes> {
+public:
+    UniqueFunction() noexcept {}
+    UniqueFunction(std::nullptr_t) noexcept {}
+
+    template<class F, class D = typename std::decay<F>::type,
+             class = typename std::enable_if<!std::is_same<D, UniqueFunction>::value>::type>
+    UniqueFunction(F&& f) {
+        construct<D>(std::forward<F>(f));
+    }
+
+    UniqueFunction(UniqueFunction&& o) noexcept { take(o); }
+    UniqueFunction(const UniqueFunction&) = delete;
+
+    UniqueFunction& operator=(UniqueFunction&& o) noexcept {
+        if (this != &o) {
+            reset();
+            take(o);
+        }
+        return *this;
+    }
+
+    UniqueFunction& operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    template<class F, class D = typename std::decay<F>::type,
+             class = typename std::enable_if<!std::is_same<D, UniqueFunction>::value>::type>
+    UniqueFunction& operator=(F&& f) {
+        reset();
+        construct<D>(std::forward<F>(f));
+        return *this;
+    }
+
+    ~UniqueFunction() { reset(); }
+
+    explicit operator bool() const noexcept { return ops != nullptr; }
+
+    R operator()(Args... args) {
+        return ops->invoke(buf, std::forward<Args>(args)...);
+    }
+
+    // True if a callable of type F is stored without allocating.
+    template<class F>
+    static constexpr bool stored_inline() {
+        return sizeof(F) <= sizeof(buf) && alignof(F) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<F>::value;
+    }
+
+private:
+    struct Ops {
+        R (*invoke)(void*, Args&&...);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    template<class D>
+    struct InlineOps {
+        static R invoke(void* p, Args&&... args) {
+            return (*static_cast<D*>(p))(std::forward<Args>(args)...);
+        }
+        static void move(void* dst, void* src) {
+            D* s = static_cast<D*>(src);
+            new (dst) D(std::move(*s));
+            s->~D();
+        }
+        static void destroy(void* p) { static_cast<D*>(p)->~D(); }
+        static constexpr Ops ops{ &invoke, &move, &destroy };
+    };
+
+    template<class D>
+    struct HeapOps {
+        static D* get(void* p) { return *static_cast<D**>(p); }
+        static R invoke(void* p, Args&&... args) {
+            return (*get(p))(std::forward<Args>(args)...);
+        }
+        static void move(void* dst, void* src) { new (dst) D*(get(src)); }
+        static void destroy(void* p) { delete get(p); }
+        static constexpr Ops ops{ &invoke, &move, &destroy };
+    };
+
+    template<class D, class F>
+    void construct(F&& f) {
+        if constexpr (stored_inline<D>()) {
+            new (buf) D(std::forward<F>(f));
+            ops = &InlineOps<D>::ops;
+        } else {
+            new (buf) D*(new D(std::forward<F>(f)));
+            ops = &HeapOps<D>::ops;
+        }
+    }
+
+    void take(UniqueFunction& o) noexcept {
+        if (!o.ops) return;
+        o.ops->move(buf, o.buf);
+        ops = o.ops;
+        o.ops = nullptr;
+    }
+
+    void reset() noexcept {
+        if (!ops) return;
+        ops->destroy(buf);
+        ops = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char buf[InlineBytes < sizeof(void*) ? sizeof(void*) : InlineBytes];
+    const Ops* ops = nullptr;
+};
@@ -0,0 +1,118 @@
+#pragma once
+#include "key_distribution.hpp"
+#include <string>
+#include <vector>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+// Sizes of the values loadgen writes, from a spec:
+//   fixed:N               always N bytes
+//   uniform:MIN:MAX       uniform in [MIN, MAX]
+//   normal:MEAN:STDDEV    normal, clamped to [1, MEAN + 5 * STDDEV]
+//   file:PATH             empirical: PATH has "<size> <weight>" lines
+//                         ('#' starts a comment), drawn via an alias table
+// Sampling is O(1) and const, so one instance is shared by all threads.
+class ValueSizeDistribution {
+public:
+    // Returns false and sets err if spec is malformed or the file unreadable.
+    bool parse(const std::string& spec, std::string& err) {
+        std::vector<std::string> parts;
+        std::stringstream ss(spec);
+        std::string part;
+        while (std::getline(ss, part, ':')) parts.push_back(part);
+        if (parts.empty()) {
+            err = "empty value size spec";
+            return false;
+        }
+        kind = parts[0];
+        try {
+            if (kind == "fixed" && parts.size() == 2) {
+                a = std::stod(parts[1]);
+                largest = (size_t)a;
+            } else if (kind == "uniform" && parts.size() == 3) {
+                a = std::stod(parts[1]);
+                b = std::stod(parts[2]);
+                if (b < a) std::swap(a, b);
+                largest = (size_t)b;
+            } else if (kind == "normal" && parts.size() == 3) {
+                a = std::stod(parts[1]);
+                b = std::stod(parts[2]);
+                if (b < 0) {
+                    err = "negative standard deviation";
+                    return false;
+                }
+                largest = (size_t)std::max(1.0, a + 5 * b);
+            } else if (kind == "file" && parts.size() >= 2) {
+                // The path may itself contain ':'.
+                return load_file(spec.substr(5), err);
+            } else {
+                err = "expected fixed:N, uniform:MIN:MAX, normal:MEAN:STDDEV or file:PATH";
+                return false;
+            }
+        } catch (const std::exception&) {
+            err = "bad number in " + spec;
+            return false;
+        }
+        // a is the smallest size for fixed and uniform, but only the mean
+        // for normal, whose samples are clamped to 1 byte.
+        if (a < (kind == "normal" ? 0 : 1) || largest < 1) {
+            err = "value sizes must be at least 1 byte";
+            return false;
+        }
+        return true;
+    }
+
+    // The largest size sample() can return.
+    size_t max() const { return largest; }
+
+    template<class Rng>
+    size_t sample(Rng& rng) const {
+        if (kind == "fixed") return largest;
+        if (kind == "uniform") return (size_t)std::uniform_int_distribution<uint64_t>((uint64_t)a, (uint64_t)b)(rng);
+        if (kind == "normal") {
+            double v = std::round(std::normal_distribution<double>(a, b)(rng));
+            return (size_t)std::min<double>(largest, std::max(1.0, v));
+        }
+        return sizes[table.sample(rng)];
+    }
+
+private:
+    bool load_file(const std::string& path, std::string& err) {
+        std::ifstream in(path);
+        if (!in) {
+            err = "cannot read " + path;
+            return false;
+        }
+        std::vector<double> weights;
+        std::string line;
+        while (std::getline(in, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream ls(line);
+            double size, weight;
+            if (!(ls >> size)) continue;
+            if (!(ls >> weight) || size < 1 || weight < 0) {
+                err = "bad line in " + path + ": " + line;
+                return false;
+            }
+            sizes.push_back((size_t)size);
+            weights.push_back(weight);
+        }
+        if (sizes.empty() || *std::max_element(weights.begin(), weights.end()) <= 0) {
+            err = path + " has no sizes with a positive weight";
+            return false;
+        }
+        table = AliasTable(weights);
+        largest = *std::max_element(sizes.begin(), sizes.end());
+        return true;
+    }
+
+    std::string kind;
+    double a = 0, b = 0;
+    size_t largest = 0;
+    std::vector<size_t> sizes;
+    AliasTable table;
+};
@@ -1,117 +1,515 @@
+#include "./include/loadgen_config.hpp"
+#include "./include/hdr_histogram.hpp"
+#include "./include/curl_event_loop.hpp"
+#include "./include/value_size.hpp"
 #include <iostream>
+#include <fstream>
+#include <iomanip>
 #include <thread>
 #include <vector>
+#include <map>
 #include <atomic>
 #include <chrono>
 #include <random>
+#include <memory>
 #include <curl/curl.h>
 
 using namespace std;
 
+// OP_INSERT is a PUT of a new key; OP_RMW a GET followed by a PUT of the
+// same key, timed as one operation.
+enum Op { OP_GET, OP_PUT, OP_DELETE, OP_INSERT, OP_RMW };
+
+// Latency is broken down by what the request was and how it went.
+enum Outcome { GET_HIT, GET_MISS, GET_OTHER, PUT_DONE, DELETE_DONE, INSERT_DONE, RMW_DONE, OUTCOME_COUNT };
+static const char* const OUTCOME_NAMES[OUTCOME_COUNT] = {
+    "GET hit", "GET miss", "GET other", "PUT", "DELETE", "INSERT", "RMW" };
+static const char* const OUTCOME_FILES[OUTCOME_COUNT] = {
+    "get_hit", "get_miss", "get_other", "put", "delete", "insert", "rmw" };
+
+// Results of one thread; merged once every thread has finished. Latencies
+// are recorded in microseconds.
 struct Stats {
-    atomic<long long> success{0};
-    atomic<long long> fail{0};
-    atomic<long long> total_ns{0};
+    long long success = 0;
+    long long fail = 0;
+    long long total_ns = 0;
+    // Open loop: requests sent more than 1 ms after their scheduled time
+    // because every transfer of the thread was busy.
+    long long late = 0;
+    HdrHistogram all;
+    HdrHistogram by_outcome[OUTCOME_COUNT];
+    // Keyed by HTTP status; 0 = no response (connection error).
+    map<long, HdrHistogram> by_status;
+
+    void merge(const Stats& o) {
+        success += o.success;
+        fail += o.fail;
+        total_ns += o.total_ns;
+        late += o.late;
+        all.merge(o.all);
+        for (int i = 0; i < OUTCOME_COUNT; i++) by_outcome[i].merge(o.by_outcome[i]);
+        for (auto& e : o.by_status) by_status[e.first].merge(e.second);
+    }
 };
 
-size_t write_callback(void* ptr, size_t size, size_t nmemb, void* userdata) {
+// Requests completed by all threads, for the progress lines.
+static atomic<long long> completed{0};
+
+// Sent on every transfer: curl labels POSTFIELDS bodies as form data,
+// which the server caps at 8 KB.
+static curl_slist* text_plain = nullptr;
+
+size_t write_callback(void*, size_t size, size_t nmemb, void*) {
     return size * nmemb; // discard body
 }
 
-void worker(string base, string mode, int duration_s, int popular_k, Stats &st, int seed_offset) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return;
+// One request to send.
+struct Request {
+    Op op = OP_GET;
+    string key;
+    // Writes: the value, a slice of Values' buffer or of value_buf.
+    const char* value = nullptr;
+    size_t value_size = 0;
+    string value_buf;
+    // OP_RMW: the read is done and the write goes out next.
+    bool modify = false;
+};
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+// Keys of the run, shared by all threads. Inserts take the next index and
+// count it as written once the server acknowledged it; reads only go to
+// acknowledged keys (as YCSB's acknowledged counter does), so latest does not
+// read keys still in flight. Out-of-order acknowledgements can still expose
+// an occasional missing key.
+struct Keyspace {
+    atomic<uint64_t> next_insert;
+    atomic<uint64_t> written;
+    explicit Keyspace(uint64_t keys) : next_insert(keys), written(keys) {}
+};
 
-    mt19937_64 rng(random_device{}() + seed_offset);
-    uniform_int_distribution<int> dist(0, 1000000);
-    uniform_int_distribution<int> popdist(0, max(1, popular_k)-1);
+// Values of the run: sizes from a ValueSizeDistribution, bytes sliced out of
+// one buffer generated up front, so a value is a pointer and a length and
+// building a request copies nothing. Alphanumeric, since a /kv_batch row can
+// hold no tab or newline. Read-only once built; shared by all threads.
+// Without a distribution (no --value-size outside the ycsb-* presets) values
+// are the short "v_<n>" strings of earlier versions, formatted into buf.
+class Values {
+public:
+    Values(const ValueSizeDistribution* sizes, uint64_t seed) : sizes(sizes) {
+        if (!sizes) return;
+        static const char chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+        mt19937_64 rng(seed);
+        bytes.resize(sizes->max() + OFFSETS);
+        for (char& c : bytes) c = chars[rng() % 62];
+    }
 
-    auto end = chrono::steady_clock::now() + chrono::seconds(duration_s);
+    // Draws a size, and a start so that values differ in content too.
+    template<class Rng>
+    void next(Rng& rng, string& buf, const char*& data, size_t& size) const {
+        if (!sizes) {
+            buf = "v_" + to_string(rng() % 1000001);
+            data = buf.data();
+            size = buf.size();
+            return;
+        }
+        size = sizes->sample(rng);
+        data = bytes.data() + rng() % OFFSETS;
+    }
 
-    while (chrono::steady_clock::now() < end) {
+private:
+    static const size_t OFFSETS = 64;
+    const ValueSizeDistribution* sizes;
+    string bytes;
+};
 
-        string key, url, body;
-        bool is_put = false;
+// Small engine seeded per key, so the load phase gives key i the same value
+// on every run whatever the batching.
+struct SplitMix64 {
+    typedef uint64_t result_type;
+    uint64_t state;
+    explicit SplitMix64(uint64_t seed) : state(seed) {}
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return UINT64_MAX; }
+    uint64_t operator()() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
 
-        if (mode == "put-all") {
-            key = "k_" + to_string(dist(rng));
-            is_put = true;
-        }
-        else if (mode == "get-all") {
-            key = "k_" + to_string(dist(rng));
-        }
-        else if (mode == "get-popular") {
-            key = "popular_" + to_string(popdist(rng));
-        }
-        else { // mixed reads + writes
-            key = "k_" + to_string(dist(rng));
-            if (dist(rng) % 3 == 0) is_put = true;
+// Name of key i of the keyspace.
+static string key_name(const LoadgenConfig& cfg, uint64_t i) {
+    return (cfg.mode == "get-popular" ? "popular_" : "k_") + to_string(i);
+}
+
+// Draws requests from cfg's operation mix, one random stream per thread,
+// seeded from cfg.seed and the thread's index.
+class RequestGen {
+public:
+    RequestGen(const LoadgenConfig& cfg, const KeyDistribution& keys, const Values& values,
+               Keyspace& keyspace, int thread_index)
+        : cfg(cfg), keys(keys), values(values), keyspace(keyspace),
+          opdist(0, cfg.read_proportion + cfg.update_proportion + cfg.insert_proportion + cfg.rmw_proportion +
+                    cfg.delete_proportion) {
+        seed_seq seq{ (uint32_t)cfg.seed, (uint32_t)(cfg.seed >> 32), (uint32_t)thread_index };
+        rng.seed(seq);
+    }
+
+    void next(Request& req) {
+        double u = opdist(rng);
+        if (u < cfg.read_proportion) req.op = OP_GET;
+        else if ((u -= cfg.read_proportion) < cfg.update_proportion) req.op = OP_PUT;
+        else if ((u -= cfg.update_proportion) < cfg.insert_proportion) req.op = OP_INSERT;
+        else if ((u -= cfg.insert_proportion) < cfg.rmw_proportion) req.op = OP_RMW;
+        else req.op = cfg.delete_proportion > 0 ? OP_DELETE : cfg.rmw_proportion > 0 ? OP_RMW : OP_GET;
+        req.modify = false;
+
+        if (req.op == OP_INSERT) req.key = key_name(cfg, keyspace.next_insert++);
+        else req.key = key_name(cfg, keys.sample(rng, keyspace.written.load()));
+        if (req.op != OP_GET && req.op != OP_DELETE) values.next(rng, req.value_buf, req.value, req.value_size);
+    }
+
+    mt19937_64& engine() { return rng; }
+
+private:
+    const LoadgenConfig& cfg;
+    const KeyDistribution& keys;
+    const Values& values;
+    Keyspace& keyspace;
+    mt19937_64 rng;
+    uniform_real_distribution<double> opdist;
+};
+
+// Points curl at req. url and req must stay alive until the transfer ends.
+static void setup_request(CURL* curl, const string& base, const Request& req, string& url) {
+    url = base + "/kv/" + req.key;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+
+    if (req.op == OP_PUT || req.op == OP_INSERT || (req.op == OP_RMW && req.modify)) {
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)req.value_size);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req.value);
+    } else if (req.op == OP_DELETE) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    } else {
+        // POSTFIELDS must be cleared before HTTPGET: setting it afterwards
+        // turns the request back into a POST whose body curl reads from stdin.
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, NULL);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    }
+}
+
+// Records one finished transfer. status is the HTTP status, 0 if the
+// transfer failed before a response arrived.
+static void record(Stats& st, const Request& req, CURL* curl, CURLcode res, long long ns) {
+    long status = 0;
+    if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    st.total_ns += ns;
+
+    if (res == CURLE_OK) st.success++;
+    else st.fail++;
+
+    long long us = ns / 1000;
+    st.all.record(us);
+    st.by_status[status].record(us);
+    if (status != 0) {
+        Outcome o = req.op == OP_PUT ? PUT_DONE : req.op == OP_DELETE ? DELETE_DONE :
+                    req.op == OP_INSERT ? INSERT_DONE : req.op == OP_RMW ? RMW_DONE :
+                    status == 200 ? GET_HIT : status == 404 ? GET_MISS : GET_OTHER;
+        st.by_outcome[o].record(us);
+    }
+
+    long long n = ++completed;
+    if (n % 10000 == 0)
+    cout << "Progress: " << n << " requests done" << endl;
+}
+
+static void print_latency_row(const string& name, const HdrHistogram& h) {
+    if (h.count() == 0) return;
+    cout << left << setw(12) << name << right << setw(10) << h.count();
+    for (double p : { 50.0, 90.0, 99.0, 99.9, 99.99 }) {
+        cout << setw(10) << h.value_at_percentile(p) / 1000.0;
+    }
+    cout << setw(10) << h.max() / 1000.0 << "\n";
+}
+
+// Latency percentiles in ms, by outcome and by HTTP status.
+static void print_latency_table(const Stats& st) {
+    cout << fixed << setprecision(3);
+    cout << left << setw(12) << "Latency(ms)" << right << setw(10) << "count"
+         << setw(10) << "p50" << setw(10) << "p90" << setw(10) << "p99"
+         << setw(10) << "p99.9" << setw(10) << "p99.99" << setw(10) << "max" << "\n";
+    print_latency_row("all", st.all);
+    for (int i = 0; i < OUTCOME_COUNT; i++) print_latency_row(OUTCOME_NAMES[i], st.by_outcome[i]);
+    for (auto& e : st.by_status) {
+        print_latency_row(e.first == 0 ? "no reply" : "status " + to_string(e.first), e.second);
+    }
+    cout.unsetf(ios::floatfield);
+}
+
+// Writes <prefix>.<name>.hgrm for every non-empty histogram, in ms.
+static void write_histograms(const string& prefix, const Stats& st) {
+    auto write = [&](const string& name, const HdrHistogram& h) {
+        if (h.count() == 0) return;
+        ofstream out(prefix + "." + name + ".hgrm");
+        if (!out) {
+            cerr << "Failed to write " << prefix << "." << name << ".hgrm" << endl;
+            return;
         }
+        h.write_percentiles(out, 1000);
+    };
+    write("all", st.all);
+    for (int i = 0; i < OUTCOME_COUNT; i++) write(OUTCOME_FILES[i], st.by_outcome[i]);
+    for (auto& e : st.by_status) write("status_" + to_string(e.first), e.second);
+}
+
+// A transfer slot: its easy handle and what curl reads while the request
+// is in flight.
+struct Transfer {
+    CURL* curl = nullptr;
+    string url;
+    Request req;
+    // Load phase: the /kv_batch body.
+    string body;
+    // When the request was due: the send time in closed loop, the
+    // scheduled time in open loop.
+    chrono::steady_clock::time_point intended;
+};
+
+// Adds up to n idle transfer slots; fewer if curl runs out of handles.
+static void make_transfers(int n, vector<unique_ptr<Transfer>>& transfers, vector<Transfer*>& idle) {
+    for (int i = 0; i < n; i++) {
+        unique_ptr<Transfer> t(new Transfer());
+        t->curl = curl_easy_init();
+        if (!t->curl) break;
+        curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, text_plain);
+        curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t.get());
+        idle.push_back(t.get());
+        transfers.push_back(move(t));
+    }
+}
+
+// One generator thread. All of its requests run on a CurlEventLoop, so a
+// thread keeps many in flight.
+//
+// Closed loop (no --rate): cfg.concurrency slots, each sending its next
+// request as soon as the last one is answered, over as many keep-alive
+// connections.
+//
+// Open loop: sends at this thread's share of cfg.rate whether or not earlier
+// requests have been answered, up to cfg.max_inflight at once over
+// cfg.connections connections. Latency is measured from the time a request
+// was scheduled, not from when it actually went out, so a server that falls
+// behind is charged for the queueing it causes (no coordinated omission).
+void worker(const LoadgenConfig& cfg, const KeyDistribution& keys, const Values& values,
+            Keyspace& keyspace, Stats& st, int thread_index) {
+    bool open_loop = cfg.rate > 0;
+    CurlEventLoop loop(open_loop ? cfg.connections : cfg.concurrency);
+    if (!loop.ok()) return;
+
+    vector<unique_ptr<Transfer>> transfers;
+    vector<Transfer*> idle;
+    make_transfers(open_loop ? cfg.max_inflight : cfg.concurrency, transfers, idle);
+
+    RequestGen gen(cfg, keys, values, keyspace, thread_index);
+    double thread_rate = cfg.rate / cfg.threads;
+    exponential_distribution<double> poisson_gap(open_loop ? thread_rate : 1.0);
+    auto gap = [&]() {
+        double s = cfg.arrival == "poisson" ? poisson_gap(gen.engine()) : 1.0 / thread_rate;
+        return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(s));
+    };
 
-        url = base + "/kv/" + key;
+    auto start = chrono::steady_clock::now();
+    auto end = start + chrono::seconds(cfg.duration_s);
+    auto next_send = open_loop ? start + gap() : start;
+    size_t inflight = 0;
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    auto send = [&](chrono::steady_clock::time_point intended) {
+        Transfer* t = idle.back();
+        idle.pop_back();
+        gen.next(t->req);
+        t->intended = intended;
+        setup_request(t->curl, cfg.base, t->req, t->url);
+        loop.add(t->curl);
+        inflight++;
+    };
 
-        if (is_put) {
-            body = "v_" + to_string(dist(rng));
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    // Sending stops at the end of the run even if an open-loop schedule is
+    // behind; requests still in flight are then waited for.
+    auto now = start;
+    while ((now < end && next_send < end) || inflight > 0) {
+        now = chrono::steady_clock::now();
+        if (!open_loop) {
+            while (now < end && !idle.empty()) send(now);
         } else {
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, NULL);
-            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+            // A send that has to wait for a free slot keeps its scheduled
+            // time, so the wait shows up as latency.
+            while (next_send <= now && next_send < end && now < end && !idle.empty()) {
+                if (now - next_send > chrono::milliseconds(1)) st.late++;
+                send(next_send);
+                next_send += gap();
+            }
         }
 
-        auto t0 = chrono::steady_clock::now();
-        auto res = curl_easy_perform(curl);
-        auto t1 = chrono::steady_clock::now();
+        // Sleep until the next send is due or a transfer has something to do.
+        int wait_ms = 100;
+        if (open_loop && next_send < end && now < end && !idle.empty()) {
+            auto until = chrono::duration_cast<chrono::milliseconds>(next_send - chrono::steady_clock::now());
+            wait_ms = (int)max<long long>(0, min<long long>(wait_ms, until.count()));
+        }
+        loop.run_once(wait_ms, [&](CURL* easy, CURLcode result) {
+            Transfer* t = nullptr;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, &t);
+            if (t->req.op == OP_RMW && !t->req.modify && result == CURLE_OK) {
+                // The read is back: write the key on the same transfer.
+                t->req.modify = true;
+                setup_request(t->curl, cfg.base, t->req, t->url);
+                loop.add(t->curl);
+                return;
+            }
+            if (t->req.op == OP_INSERT && result == CURLE_OK) keyspace.written++;
+            auto done = chrono::steady_clock::now();
+            record(st, t->req, t->curl, result,
+                   chrono::duration_cast<chrono::nanoseconds>(done - t->intended).count());
+            idle.push_back(t);
+            inflight--;
+        });
+    }
 
-        long long ns = chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count();
-        st.total_ns += ns;
+    for (auto& t : transfers) curl_easy_cleanup(t->curl);
+}
 
-        if (res == CURLE_OK) st.success++;
-        else st.fail++;
+// Load phase: writes every key of the keyspace once, cfg.load_batch rows
+// per POST /kv_batch, so the run reads keys that exist. Thread i sends
+// batches i, i + threads, ... with cfg.concurrency in flight. Key i's value
+// is drawn from an engine seeded with cfg.seed and i, so a load is the same
+// on every run. Returns the number of batches that failed.
+static long long load_keys(const LoadgenConfig& cfg, const Values& values) {
+    atomic<long long> failed{0};
+    uint64_t batches = (cfg.keys + cfg.load_batch - 1) / cfg.load_batch;
+    string url = cfg.base + "/kv_batch";
 
-        if (st.success % 10000 == 0)
-        cout << "Progress: " << st.success << " requests done" << endl;
+    auto load = [&](int index) {
+        CurlEventLoop loop(cfg.concurrency);
+        if (!loop.ok()) {
+            failed++;
+            return;
+        }
+        vector<unique_ptr<Transfer>> transfers;
+        vector<Transfer*> idle;
+        make_transfers(cfg.concurrency, transfers, idle);
+        for (auto& t : transfers) curl_easy_setopt(t->curl, CURLOPT_URL, url.c_str());
 
-    }
+        string value_buf;
+        uint64_t batch = index;
+        size_t inflight = 0;
+        while (batch < batches || inflight > 0) {
+            while (batch < batches && !idle.empty()) {
+                Transfer* t = idle.back();
+                idle.pop_back();
+                string& body = t->body;
+                body.clear();
+                uint64_t last = min<uint64_t>(cfg.keys, (batch + 1) * cfg.load_batch);
+                for (uint64_t i = batch * cfg.load_batch; i < last; i++) {
+                    SplitMix64 rng(cfg.seed ^ (i * 0xd1b54a32d192ed03ULL));
+                    const char* value;
+                    size_t size;
+                    values.next(rng, value_buf, value, size);
+                    body += key_name(cfg, i);
+                    body += '\t';
+                    body.append(value, size);
+                    body += '\n';
+                }
+                curl_easy_setopt(t->curl, CURLOPT_POSTFIELDSIZE, (long)body.size());
+                curl_easy_setopt(t->curl, CURLOPT_POSTFIELDS, body.c_str());
+                loop.add(t->curl);
+                inflight++;
+                batch += cfg.threads;
+            }
+            loop.run_once(100, [&](CURL* easy, CURLcode result) {
+                Transfer* t = nullptr;
+                curl_easy_getinfo(easy, CURLINFO_PRIVATE, &t);
+                long status = 0;
+                if (result == CURLE_OK) curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+                if (status != 201) failed++;
+                idle.push_back(t);
+                inflight--;
+            });
+        }
+        for (auto& t : transfers) curl_easy_cleanup(t->curl);
+    };
 
-    curl_easy_cleanup(curl);
+    vector<thread> pool;
+    for (int i = 0; i < cfg.threads; i++) pool.emplace_back(load, i);
+    for (auto& t : pool) t.join();
+    return failed;
 }
 
 int main(int argc, char** argv) {
-    if (argc < 6) {
-        cout << "Usage: ./loadgen <base-url> <mode> <threads> <duration-s> <popular-k>\n";
-        cout << "Modes: put-all, get-all, get-popular, mixed\n";
+    LoadgenConfig cfg;
+    if (!parse_loadgen_args(argc, argv, cfg)) return 1;
+
+    KeyDistribution::Options key_opts;
+    key_opts.kind = cfg.key_dist;
+    key_opts.keys = cfg.keys;
+    key_opts.theta = cfg.zipf_theta;
+    key_opts.hot_keys = cfg.hotspot_keys;
+    key_opts.hot_ops = cfg.hotspot_ops;
+    key_opts.seed = cfg.seed;
+    KeyDistribution keys(key_opts);
+
+    ValueSizeDistribution sizes;
+    string err;
+    if (!cfg.value_size.empty() && !sizes.parse(cfg.value_size, err)) {
+        cerr << "Bad --value-size: " << err << endl;
         return 1;
     }
-
-    string base = argv[1];
-    string mode = argv[2];
-    int threads = stoi(argv[3]);
-    int duration = stoi(argv[4]);
-    int popular_k = stoi(argv[5]);
+    Values values(cfg.value_size.empty() ? nullptr : &sizes, cfg.seed);
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    text_plain = curl_slist_append(nullptr, "Content-Type: text/plain");
 
-    Stats st;
+    if (cfg.load) {
+        auto start = chrono::steady_clock::now();
+        long long failed = load_keys(cfg, values);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Loaded " << cfg.keys << " keys in " << secs << " s (" << cfg.keys / secs << " keys/s)";
+        if (failed) cout << ", " << failed << " batches failed";
+        cout << endl;
+    }
+    Keyspace keyspace(cfg.keys);
+
+    vector<unique_ptr<Stats>> stats;
     vector<thread> pool;
 
-    for (int i = 0; i < threads; i++)
-        pool.emplace_back(worker, base, mode, duration, popular_k, ref(st), i);
+    for (int i = 0; i < cfg.threads; i++) {
+        stats.emplace_back(new Stats());
+        pool.emplace_back(worker, cref(cfg), cref(keys), cref(values), ref(keyspace), ref(*stats.back()), i);
+    }
 
     for (auto &t : pool) t.join();
 
+    curl_slist_free_all(text_plain);
     curl_global_cleanup();
 
-    long long s = st.success.load();
-    long long f = st.fail.load();
-    double avg_ms = s ? (st.total_ns.load() / 1e6) / s : 0;
+    Stats st;
+    for (auto& s : stats) st.merge(*s);
+
+    long long s = st.success;
+    long long f = st.fail;
+    double avg_ms = s ? (st.total_ns / 1e6) / s : 0;
 
     cout << "Success=" << s << " Fail=" << f << " AvgLatency(ms)=" << avg_ms << "\n";
+    if (cfg.rate > 0) {
+        cout << "TargetRate=" << cfg.rate << " AchievedRate=" << (double)(s + f) / cfg.duration_s
+             << " Late=" << st.late << "\n";
+    }
+    print_latency_table(st);
+    if (!cfg.histogram_out.empty()) write_histograms(cfg.histogram_out, st);
     return 0;
 }
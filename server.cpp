@@ -1,177 +1,903 @@
 #include "./include/httplib.h"
-#include <hiredis/hiredis.h>
+#include "./include/thread_pool.hpp"
+#include "./include/adaptive_limit.hpp"
+#include "./include/deadline.hpp"
+#include "./include/server_config.hpp"
+#include "./include/cache_entry.hpp"
+#include "./include/hot_keys.hpp"
+#include "./include/redis_cache.hpp"
+#include "./include/pg_storage.hpp"
+#include "./include/log_storage.hpp"
+#include "./include/memory_backends.hpp"
 #include <libpq-fe.h>
 #include <iostream>
 #include <chrono>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <condition_variable>
+#include <memory>
+#include <csignal>
+#include <pthread.h>
 
 using namespace std;
 
-mutex redis_mutex;
-mutex pg_mutex;
+// Keys with a background refresh queued or running, so a hot stale key
+// triggers one PG lookup instead of one per concurrent GET.
+mutex refresh_mutex;
+unordered_set<string> refresh_inflight;
 
-int main() {
-    redisContext* redis = redisConnect("127.0.0.1", 6379);
-    if (!redis || redis->err) {
-        cerr << "Redis connection failed" << endl;
-        return 1;
+// Orders background refreshes against client writes of the same key. Keys
+// hash to a stripe whose generation every committed write bumps before it
+// updates the cache (and once more after, see drop_hot in main). A refresh
+// or a GET that fills the cache or the hot-key replica notes the generation
+// before its read and writes only if it is unchanged, checking and writing
+// under the stripe lock, so a write that commits meanwhile always has the
+// last say.
+class WriteGenerations {
+public:
+    uint64_t current(const string& key) {
+        Stripe& s = stripe(key);
+        lock_guard<mutex> lock(s.mu);
+        return s.gen;
     }
-    cout << "Connected to Redis" << endl;
 
-    PGconn* pg = PQconnectdb("host=127.0.0.1 dbname=kvstore user=kvuser password=kvpass");
-    if (PQstatus(pg) != CONNECTION_OK) {
-        cerr << "PostgreSQL connection failed" << endl;
-        return 1;
+    void bump(const string& key) {
+        Stripe& s = stripe(key);
+        lock_guard<mutex> lock(s.mu);
+        s.gen++;
     }
-    cout << "Connected to PostgreSQL" << endl;
 
-    httplib::Server svr;
+    // Runs fn under the stripe lock if no write bumped key's stripe since
+    // `seen`. Returns whether fn ran.
+    template<class F>
+    bool if_unchanged(const string& key, uint64_t seen, F fn) {
+        Stripe& s = stripe(key);
+        lock_guard<mutex> lock(s.mu);
+        if (s.gen != seen) return false;
+        fn();
+        return true;
+    }
+
+private:
+    struct Stripe {
+        mutex mu;
+        uint64_t gen = 0;
+    };
+    Stripe& stripe(const string& key) { return stripes[hash<string>()(key) % STRIPES]; }
+
+    static const size_t STRIPES = 256;
+    Stripe stripes[STRIPES];
+};
+WriteGenerations write_gens;
+
+// Wraps val with freshness/expiry timestamps and the fetch cost when soft TTL
+// or a hard TTL is on.
+static string encode_for_cache(const ServerConfig& cfg, const string& val, long long fetch_us) {
+    long long now = wall_clock_ms();
+    CacheEntry entry;
+    entry.fresh_until_ms = cfg.soft_ttl_ms > 0 ? now + cfg.soft_ttl_ms : 0;
+    entry.expires_at_ms = cfg.hard_ttl_ms > 0 ? now + cfg.hard_ttl_ms : 0;
+    entry.delta_us = fetch_us;
+    entry.value = val;
+    return encode_cache_entry(entry);
+}
+
+// Writes val to the cache. With only_if_exists the write is XX, so a refresh
+// racing a DELETE cannot bring the key back.
+static void cache_set(CacheBackend& cache, const ServerConfig& cfg,
+                      const string& key, const string& val, long long fetch_us,
+                      bool only_if_exists = false) {
+    cache.set(key, encode_for_cache(cfg, val, fetch_us), cfg.hard_ttl_ms,
+              only_if_exists ? CacheSetMode::IfExists : CacheSetMode::Always);
+}
+
+// Caches every row in one batch (one pipeline per Redis shard). Warm-up
+// passes IfAbsent so it never overwrites a newer value cached by live traffic.
+static void cache_set_batch(CacheBackend& cache, const ServerConfig& cfg,
+                            const vector<pair<string, string>>& rows, CacheSetMode mode) {
+    CacheBackend::Rows encoded;
+    encoded.reserve(rows.size());
+    for (auto& row : rows) encoded.emplace_back(row.first, encode_for_cache(cfg, row.second, 0));
+    cache.set_batch(encoded, cfg.hard_ttl_ms, mode);
+}
+
+// Lanes of the worker pool. Connections and background refreshes each get
+// a capped number of workers, so refreshes can never hold a worker that a
+// client is waiting for, and a backlog of clients cannot starve refreshes.
+enum WorkerLane {
+    LANE_HTTP = 0,
+    LANE_BACKGROUND = 1,
+};
+
+// Runs httplib's connection tasks in the HTTP lane of the work-stealing
+// ThreadPool instead of httplib's single-queue pool. When the lane's bounded
+// queue is full the connection is handed to the shed pool, whose worker only
+// answers 503 (see SheddingServer and the pre-routing handler in main), so a
+// spike is turned away quickly instead of building an ever-growing backlog.
+// If the shed pool is full as well, httplib closes the socket.
+class PoolTaskQueue : public httplib::TaskQueue {
+public:
+    PoolTaskQueue(ThreadPool& pool, ThreadPool& shed) : pool(pool), shed(shed) {}
 
-    svr.Put(R"(/kv/(.*))", [&](const httplib::Request& req, httplib::Response& res) {
-        auto start = chrono::high_resolution_clock::now();
-        string key = req.matches[1];
-        string val = req.body;
-        cout << "[REQ] PUT key=" << key << endl;
+    bool enqueue(function<void()> fn) override {
+        // try_enqueue leaves fn intact when it refuses it.
+        return pool.try_enqueue(std::move(fn), LANE_HTTP) || shed.try_enqueue(std::move(fn));
+    }
+
+    // The pools belong to main, which drains them after listen() returns.
+    void shutdown() override {}
+
+private:
+    ThreadPool& pool;
+    ThreadPool& shed;
+};
+
+// httplib::Server that gives shed connections a short leash. The shed pool
+// reads a request only to answer it with 503, so a client that is slow to
+// send its request gets SHED_READ_TIMEOUT_US per read instead of the
+// keep-alive and read timeouts (seconds each) and cannot hold up shedding
+// for everyone behind it. Other connections are served exactly as by
+// httplib::Server::process_and_close_socket, which this mirrors.
+class SheddingServer : public httplib::Server {
+public:
+    static const time_t SHED_READ_TIMEOUT_US = 100000;
+
+    explicit SheddingServer(ThreadPool& shed) : shed(shed) {}
+
+private:
+    bool process_and_close_socket(socket_t sock) override {
+        bool shedding = shed.on_worker_thread();
+        if (shedding && httplib::detail::select_read(sock, 0, SHED_READ_TIMEOUT_US) <= 0) {
+            httplib::detail::shutdown_socket(sock);
+            httplib::detail::close_socket(sock);
+            return false;
+        }
+
+        string remote_addr, local_addr;
+        int remote_port = 0, local_port = 0;
+        httplib::detail::get_remote_ip_and_port(sock, remote_addr, remote_port);
+        httplib::detail::get_local_ip_and_port(sock, local_addr, local_port);
+
+        bool ret = httplib::detail::process_server_socket(
+            svr_sock_, sock,
+            shedding ? 1 : keep_alive_max_count_,
+            shedding ? 0 : keep_alive_timeout_sec_,
+            shedding ? 0 : read_timeout_sec_,
+            shedding ? SHED_READ_TIMEOUT_US : read_timeout_usec_,
+            write_timeout_sec_, write_timeout_usec_,
+            [&](httplib::Stream& strm, bool close_connection, bool& connection_closed) {
+                return process_request(strm, remote_addr, remote_port, local_addr, local_port,
+                                       close_connection, connection_closed, nullptr);
+            });
+
+        httplib::detail::shutdown_socket(sock);
+        httplib::detail::close_socket(sock);
+        return ret;
+    }
 
+    ThreadPool& shed;
+};
+
+// 503 asking the client to retry shortly, for requests turned away by a full
+// queue or a concurrency cap.
+static void reply_busy(httplib::Response& res) {
+    res.status = 503;
+    res.set_header("Retry-After", "1");
+    res.set_content("Server busy\n", "text/plain");
+}
+
+// 504 for a request whose X-Deadline-Ms ran out before its backend work
+// could be done; the work is dropped rather than finished for nobody.
+static void reply_deadline(httplib::Response& res) {
+    res.status = 504;
+    res.set_content("Deadline exceeded\n", "text/plain");
+}
+
+// A request admitted by the adaptive limit in the pre-routing handler is
+// settled in the post-routing handler. A worker serves one request at a
+// time, so the two are matched through the thread.
+struct AdmittedRequest {
+    bool admitted = false;
+    chrono::steady_clock::time_point start;
+};
+static thread_local AdmittedRequest admitted_request;
+
+// Admin and readiness endpoints bypass the adaptive limit so the limit can
+// be watched, and health-checked, while it is shedding.
+static bool exempt_from_limit(const string& path) {
+    return path == "/ready" || path.compare(0, 7, "/admin/") == 0;
+}
+
+// Binds svr to host:port without starting its accept loop. The socket gets
+// SO_REUSEPORT (so several listeners can share the port), SO_INCOMING_CPU
+// when cpu >= 0 (so the kernel prefers it for connections received on that
+// CPU) and a listen backlog of `backlog` instead of httplib's 5.
+static bool bind_listener(httplib::Server& svr, const string& host, int port, int backlog, int cpu) {
+    socket_t fd = INVALID_SOCKET;
+    svr.set_socket_options([&fd, cpu](socket_t sock) {
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+#ifdef SO_INCOMING_CPU
+        if (cpu >= 0) setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+#endif
+        fd = sock;
+    });
+    bool ok = svr.bind_to_port(host, port);
+    svr.set_socket_options(httplib::default_socket_options);
+    if (!ok) return false;
+    // Calling listen() again on a listening socket only changes its backlog.
+    if (::listen(fd, backlog) != 0) {
+        cerr << "listen(backlog=" << backlog << ") failed: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+// Reads key from storage as StorageBackend::lookup does (1 found, 0
+// missing, -1 error). fetch_us receives the lookup time, which XFetch uses
+// as the recompute cost of the cached value.
+static int timed_lookup(StorageBackend& db, const string& key, string& val, long long& fetch_us) {
+    auto start = chrono::steady_clock::now();
+    int found = db.lookup(key, val);
+    fetch_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    return found;
+}
+
+// Keys deleted while the warm-up runs. Its rows were read from storage
+// before the delete may have happened, and SET NX cannot tell an old row
+// from a missing key, so it must skip these. A batch is filtered and cached
+// under mu, and DELETE records its key under mu before evicting it, so a
+// delete either comes before the filter or evicts after the write.
+struct WarmupDeletes {
+    mutex mu;
+    bool active = false;
+    unordered_set<string> keys;
+
+    void note(const string& key) {
+        lock_guard<mutex> lock(mu);
+        if (active) keys.insert(key);
+    }
+};
+
+// Loads the working set into the cache in two phases:
+//   1. the keys of the persisted frequency snapshot, most frequent first,
+//      fetched with batched lookups;
+//   2. up to cfg.warmup_rows of the most recently written rows, as the
+//      storage backend streams them.
+// Each batch is one cache batch write, and batches are paced to cfg.warmup_rate rows per second so live traffic keeps its share.
+static void run_warmup(const ServerConfig& cfg, CacheBackend& cache, StorageBackend& db,
+                       const vector<string>& preload, WarmupDeletes& deletes) {
+    auto start = chrono::steady_clock::now();
+    long long loaded = 0;
+    auto next_batch = chrono::steady_clock::now();
+
+    // Pushes rows to the cache and waits out the rate limit.
+    auto load_rows = [&](const StorageBackend::Rows& rows) {
         {
-            lock_guard<mutex> lock(pg_mutex);
-            const char* params[2] = { key.c_str(), val.c_str() };
-            PGresult* r = PQexecParams(pg,
-                "INSERT INTO kv (k, v) VALUES ($1, $2) ON CONFLICT (k) DO UPDATE SET v = EXCLUDED.v",
-                2, NULL, params, NULL, NULL, 0);
-            if (PQresultStatus(r) != PGRES_COMMAND_OK) {
-                PQclear(r);
-                res.status = 500;
-                return;
+            lock_guard<mutex> lock(deletes.mu);
+            StorageBackend::Rows live;
+            for (auto& row : rows) {
+                if (!deletes.keys.count(row.first)) live.push_back(row);
             }
-            PQclear(r);
+            if (!live.empty()) cache_set_batch(cache, cfg, live, CacheSetMode::IfAbsent);
+            loaded += live.size();
         }
 
-        {
-            lock_guard<mutex> lock(redis_mutex);
-            redisReply* r = (redisReply*)redisCommand(redis, "SET %s %s", key.c_str(), val.c_str());
-            if (r) freeReplyObject(r);
+        if (cfg.warmup_rate > 0) {
+            next_batch += chrono::microseconds((long long)rows.size() * 1000000LL / cfg.warmup_rate);
+            this_thread::sleep_until(next_batch);
         }
+    };
 
-        cout << "[WRITE] Stored key=" << key << " in DB and Cache" << endl;
-        auto end = chrono::high_resolution_clock::now();
-        cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us" << endl;
-        res.status = 201;
-    });
+    for (size_t i = 0; i < preload.size(); i += cfg.warmup_batch) {
+        size_t end = min(preload.size(), i + (size_t)cfg.warmup_batch);
+        load_rows(db.get_batch(vector<string>(preload.begin() + i, preload.begin() + end)));
+    }
+    long long from_snapshot = loaded;
+
+    if (cfg.warmup_rows > 0) db.scan_recent(cfg.warmup_rows, cfg.warmup_batch, load_rows);
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    {
+        lock_guard<mutex> lock(deletes.mu);
+        deletes.active = false;
+        deletes.keys.clear();
+    }
+    cout << "[WARMUP] loaded " << loaded << " keys (" << from_snapshot << " from snapshot) in "
+         << ms << " ms" << endl;
+}
+
+int main(int argc, char** argv) {
+    ServerConfig cfg;
+    if (!parse_server_args(argc, argv, cfg)) return 1;
+
+    // SIGINT and SIGTERM are taken by a thread waiting in sigwait() once the
+    // listeners run. Block them before any thread starts so every thread
+    // inherits the mask and none of them is interrupted instead.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+    unique_ptr<CacheBackend> cache_backend;
+    if (cfg.cache == "memory") {
+        cache_backend.reset(new MemoryCache());
+    } else if (cfg.cache == "none") {
+        cache_backend.reset(new NullCache());
+    } else {
+        cache_backend.reset(new ShardedRedis(cfg.redis_endpoints, cfg.redis_pool_size));
+    }
+    if (!cache_backend->open()) return 1;
+    CacheBackend& cache = *cache_backend;
+    cout << "Connected to " << cache.describe() << endl;
+
+    unique_ptr<StorageBackend> storage;
+    if (cfg.storage == "log") {
+        storage.reset(new LogStorage(cfg.log));
+    } else if (cfg.storage == "memory") {
+        storage.reset(new MemoryStorage());
+    } else {
+        storage.reset(new PgRouter(cfg.pg_shards, cfg.pg_replicas, cfg.pg_pool_size, cfg.replica_safety_ms));
+    }
+    if (!storage->open()) return 1;
+    StorageBackend& db = *storage;
+    cout << "Connected to " << db.describe() << endl;
+
+    // One sketch serves both hot-key detection and the frequency snapshot.
+    // With --hot-keys=0 it still counts accesses for the snapshot, but no key
+    // is reported hot, so nothing is replicated.
+    HotKeySketch hot_sketch(max(cfg.hot_keys, cfg.snapshot_keys), cfg.hot_fraction, cfg.hot_window_ms);
+
+    // Keys from the last run's snapshot drive the warm-up order and seed the
+    // sketch, so the next snapshot does not start from nothing.
+    vector<string> preload;
+    if (cfg.snapshot_keys > 0) {
+        for (auto& item : load_freq_snapshot(cfg.snapshot_file)) {
+            hot_sketch.seed(item.key, item.count);
+            preload.push_back(item.key);
+        }
+        if (!preload.empty()) {
+            cout << "Loaded " << preload.size() << " keys from " << cfg.snapshot_file << endl;
+        }
+    }
+    HotKeyReplica hot_replica(cfg.hot_ttl_ms);
+
+    // Pins a hot key's value locally so repeated GETs skip the cache.
+    auto replicate_hot = [&](const string& key, const string& val) {
+        hot_replica.put(key, val);
+        if (hot_replica.size() > (size_t)cfg.hot_keys * 2) hot_replica.purge_expired();
+    };
+
+    // Last step of a write, after its cache update. GETs pin a value only if
+    // the key's write generation is unchanged since before their cache or
+    // storage read, so this second bump either fails the check of a GET
+    // still holding the old value or follows its pin, which is dropped here.
+    auto drop_hot = [&](const string& key) {
+        write_gens.bump(key);
+        hot_replica.invalidate(key);
+    };
+
+    size_t http_threads = cfg.http_threads > 0 ? (size_t)cfg.http_threads : CPPHTTPLIB_THREAD_POOL_COUNT;
+    vector<int> worker_cpus;
+    if (cfg.cpus == "auto") {
+        worker_cpus = cpus_by_numa_node(allowed_cpus());
+    } else if (cfg.cpus != "none") {
+        parse_cpu_list(cfg.cpus, worker_cpus);
+    }
+    if (!worker_cpus.empty()) {
+        cout << "Pinning workers to " << worker_cpus.size() << " CPUs on "
+             << numa_node_count(worker_cpus) << " NUMA node(s)" << endl;
+    }
+    // LANE_HTTP is capped so connections, which hold a worker for their
+    // whole keep-alive, can never occupy the refresh workers. The caps count
+    // tasks waiting in the workers' deques too, so a worker that takes a
+    // share of the connection backlog for idle workers to steal stays
+    // within them.
+    ThreadPool workers(http_threads + cfg.refresh_threads, cfg.http_queue, {
+        { 8, http_threads },                       // LANE_HTTP
+        { 1, (size_t)cfg.refresh_threads },        // LANE_BACKGROUND
+    }, worker_cpus);
+    ThreadPool shed_pool(1, cfg.http_queue);
 
-    svr.Get(R"(/kv/(.*))", [&](const httplib::Request& req, httplib::Response& res) {
-        auto start = chrono::high_resolution_clock::now();
-        string key = req.matches[1];
-        cout << "[REQ] GET key=" << key << endl;
+    // Storage-bound sections of the handlers are capped so a storm of slow
+    // writes (or cache misses) leaves workers free for cache hits. As many
+    // requests again may wait for a slot; the rest get 503.
+    ConcurrencyLimit db_writes(cfg.db_write_limit, cfg.db_write_limit);
+    ConcurrencyLimit db_reads(cfg.db_read_limit, cfg.db_read_limit);
 
-        redisReply* reply = nullptr;
+    // Latency-driven cap on requests being served. Past it requests get 503
+    // straight away rather than adding to a backend queue that would slow
+    // every request down.
+    unique_ptr<AdaptiveLimit> adaptive_limit;
+    if (cfg.adaptive_limit > 0) {
+        AdaptiveLimitOptions opts;
+        opts.initial = (size_t)cfg.adaptive_limit;
+        opts.min = (size_t)cfg.adaptive_limit_min;
+        opts.max = cfg.adaptive_limit_max > 0 ? (size_t)cfg.adaptive_limit_max : http_threads;
+        opts.tolerance = cfg.adaptive_tolerance;
+        adaptive_limit.reset(new AdaptiveLimit(opts));
+        cout << "Adaptive request limit " << adaptive_limit->limit() << " (range "
+             << opts.min << "-" << opts.max << ")" << endl;
+    }
+    atomic<unsigned long long> shed_count{0};
+
+    // Re-reads key from storage and rewrites the cache entry off the request path.
+    // At most one refresh per key is in flight at a time.
+    auto schedule_refresh = [&](const string& key) {
         {
-            lock_guard<mutex> lock(redis_mutex);
-            reply = (redisReply*)redisCommand(redis, "GET %s", key.c_str());
+            lock_guard<mutex> lock(refresh_mutex);
+            if (!refresh_inflight.insert(key).second) return;
+        }
+        bool queued = workers.try_enqueue([&, key]() {
+            uint64_t gen = write_gens.current(key);
+            string val;
+            long long fetch_us = 0;
+            int found = timed_lookup(db, key, val, fetch_us);
+            // A storage error keeps the cached value; only a row confirmed
+            // missing evicts the key. A write since the read wins either way.
+            if (found > 0) {
+                bool wrote = write_gens.if_unchanged(key, gen, [&]() {
+                    cache_set(cache, cfg, key, val, fetch_us, true);
+                    hot_replica.invalidate(key);
+                });
+                if (wrote) cout << "[REFRESH] key=" << key << endl;
+            } else if (found == 0) {
+                write_gens.if_unchanged(key, gen, [&]() { cache.del(key); });
+            } else {
+                cout << "[REFRESH FAILED] key=" << key << endl;
+            }
+            lock_guard<mutex> lock(refresh_mutex);
+            refresh_inflight.erase(key);
+        }, LANE_BACKGROUND);
+        if (!queued) {
+            // Refreshes are backed up: keep serving the cached value and let
+            // a later GET try again.
+            lock_guard<mutex> lock(refresh_mutex);
+            refresh_inflight.erase(key);
         }
+    };
 
-        if (reply && reply->type == REDIS_REPLY_STRING) {
-            cout << "[CACHE HIT] key=" << key << endl;
-            res.set_content(reply->str, "text/plain");
-            res.status = 200;
-            freeReplyObject(reply);
-            auto end = chrono::high_resolution_clock::now();
-            cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
-            return;
+    // Readiness for the load balancer: false until the warm-up has run, so
+    // traffic is only routed here once the cache holds the working set.
+    atomic<bool> ready{cfg.warmup_rows == 0 && preload.empty()};
+    WarmupDeletes warmup_deletes;
+    warmup_deletes.active = !ready;
+    thread warmup_thread;
+    if (!ready) {
+        warmup_thread = thread([&]() {
+            run_warmup(cfg, cache, db, preload, warmup_deletes);
+            ready = true;
+        });
+    }
+
+    // Periodically persists the sketch; the last write happens on shutdown.
+    mutex snapshot_mutex;
+    condition_variable snapshot_cv;
+    bool stopping = false;
+    auto write_snapshot = [&]() {
+        if (!save_freq_snapshot(cfg.snapshot_file, hot_sketch.top(cfg.snapshot_keys))) {
+            cerr << "Failed to write " << cfg.snapshot_file << endl;
         }
+    };
+    thread snapshot_thread;
+    if (cfg.snapshot_keys > 0) {
+        snapshot_thread = thread([&]() {
+            unique_lock<mutex> lock(snapshot_mutex);
+            while (!snapshot_cv.wait_for(lock, chrono::milliseconds(cfg.snapshot_interval_ms),
+                                         [&] { return stopping; })) {
+                write_snapshot();
+            }
+        });
+    }
 
-        if (reply) freeReplyObject(reply);
-        cout << "[CACHE MISS] key=" << key << endl;
+    // Handlers, task queue and shedding for one listener. Every listener
+    // serves the same routes and shares the worker pool.
+    auto setup_server = [&](httplib::Server& svr) {
+        svr.new_task_queue = [&]() { return new PoolTaskQueue(workers, shed_pool); };
+        // httplib writes headers and body separately; without this, Nagle
+        // holds the body back until the client's delayed ACK (~40 ms).
+        svr.set_tcp_nodelay(true);
 
-        string val;
-        {
-            lock_guard<mutex> lock(pg_mutex);
-            const char* params[1] = { key.c_str() };
-            PGresult* r = PQexecParams(pg, "SELECT v FROM kv WHERE k=$1",
-                                       1, NULL, params, NULL, NULL, 0);
-            if (PQresultStatus(r) != PGRES_TUPLES_OK || PQntuples(r) == 0) {
+        // Connections that overflowed the HTTP queue run on shed_pool and get an
+        // immediate 503 asking the client to come back later. Past the
+        // adaptive limit a request gets the same answer but keeps its
+        // connection.
+        //
+        // X-Deadline-Ms is the time in ms the client will wait for an answer.
+        // It becomes the thread's request deadline, which bounds every cache
+        // and storage call the handler makes.
+        svr.set_pre_routing_handler([&](const httplib::Request& req, httplib::Response& res) {
+            if (shed_pool.on_worker_thread()) {
+                shed_count++;
+                cout << "[SHED] " << req.method << " " << req.path << endl;
+                reply_busy(res);
+                res.set_header("Connection", "close");
+                return httplib::Server::HandlerResponse::Handled;
+            }
+            if (req.has_header("X-Deadline-Ms")) {
+                long long ms;
+                try {
+                    ms = stoll(req.get_header_value("X-Deadline-Ms"));
+                } catch (const exception&) {
+                    res.status = 400;
+                    res.set_content("Bad X-Deadline-Ms\n", "text/plain");
+                    return httplib::Server::HandlerResponse::Handled;
+                }
+                if (ms <= 0) {
+                    cout << "[EXPIRED] " << req.method << " " << req.path << endl;
+                    reply_deadline(res);
+                    return httplib::Server::HandlerResponse::Handled;
+                }
+                current_deadline() = chrono::steady_clock::now() + chrono::milliseconds(ms);
+            }
+            if (!adaptive_limit || exempt_from_limit(req.path)) return httplib::Server::HandlerResponse::Unhandled;
+            if (!adaptive_limit->try_acquire()) {
+                cout << "[LIMIT] " << req.method << " " << req.path << " limit=" << adaptive_limit->limit() << endl;
+                reply_busy(res);
+                return httplib::Server::HandlerResponse::Handled;
+            }
+            admitted_request.admitted = true;
+            admitted_request.start = chrono::steady_clock::now();
+            return httplib::Server::HandlerResponse::Unhandled;
+        });
+
+        // Runs for every response, just before it is written, so the sample
+        // is the time spent serving the request.
+        svr.set_post_routing_handler([&](const httplib::Request&, httplib::Response& res) {
+            current_deadline() = Deadline::max();
+            if (!admitted_request.admitted) return;
+            admitted_request.admitted = false;
+            long long us = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - admitted_request.start).count();
+            adaptive_limit->release(us, res.status < 500);
+        });
+
+        svr.Put(R"(/kv/(.*))", [&](const httplib::Request& req, httplib::Response& res) {
+            auto start = chrono::high_resolution_clock::now();
+            string key = req.matches[1];
+            string val = req.body;
+            cout << "[REQ] PUT key=" << key << endl;
+
+            auto permit = db_writes.acquire();
+            if (!permit) {
+                reply_busy(res);
+                return;
+            }
+            if (deadline_expired()) {
+                reply_deadline(res);
+                return;
+            }
+            auto db_start = chrono::steady_clock::now();
+            if (!db.put(key, val)) {
+                if (deadline_expired()) reply_deadline(res);
+                else res.status = 500;
+                return;
+            }
+
+            // The write is committed; the cache must follow it even if the
+            // deadline passes meanwhile.
+            DeadlineScope committed(Deadline::max());
+            write_gens.bump(key);
+            long long write_us = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - db_start).count();
+            cache_set(cache, cfg, key, val, write_us);
+            drop_hot(key);
+
+            cout << "[WRITE] Stored key=" << key << " in DB and Cache" << endl;
+            auto end = chrono::high_resolution_clock::now();
+            cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us" << endl;
+            res.status = 201;
+        });
+
+        svr.Get(R"(/kv/(.*))", [&](const httplib::Request& req, httplib::Response& res) {
+            auto start = chrono::high_resolution_clock::now();
+            string key = req.matches[1];
+            cout << "[REQ] GET key=" << key << endl;
+
+            bool hot = hot_sketch.record(key) && cfg.hot_keys > 0;
+            string hot_val;
+            if (hot && hot_replica.get(key, hot_val)) {
+                cout << "[HOT HIT] key=" << key << endl;
+                res.set_content(hot_val, "text/plain");
+                res.status = 200;
+                auto end = chrono::high_resolution_clock::now();
+                cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
+                return;
+            }
+
+            uint64_t gen = hot ? write_gens.current(key) : 0;
+            string cached;
+            if (cache.get(key, cached)) {
+                CacheEntry entry = decode_cache_entry(cached.data(), cached.size());
+                long long now = wall_clock_ms();
+                if (cache_entry_stale(entry, now)) {
+                    cout << "[CACHE STALE] key=" << key << endl;
+                    schedule_refresh(key);
+                } else if (xfetch_should_refresh(entry, now, cfg.xfetch_beta)) {
+                    cout << "[CACHE HIT] key=" << key << " (early refresh)" << endl;
+                    schedule_refresh(key);
+                } else {
+                    cout << "[CACHE HIT] key=" << key << endl;
+                }
+                if (hot) {
+                    // Not a value a write replaced since the read.
+                    write_gens.if_unchanged(key, gen, [&]() { replicate_hot(key, entry.value); });
+                }
+                res.set_content(entry.value, "text/plain");
+                res.status = 200;
+                auto end = chrono::high_resolution_clock::now();
+                cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
+                return;
+            }
+
+            cout << "[CACHE MISS] key=" << key << endl;
+
+            auto permit = db_reads.acquire();
+            if (!permit) {
+                reply_busy(res);
+                return;
+            }
+            if (deadline_expired()) {
+                reply_deadline(res);
+                return;
+            }
+            gen = write_gens.current(key);
+            string val;
+            long long fetch_us = 0;
+            int found = timed_lookup(db, key, val, fetch_us);
+            if (found < 0) {
+                if (deadline_expired()) reply_deadline(res);
+                else res.status = 500;
+                return;
+            }
+            if (found == 0) {
                 cout << "[DB MISS] key=" << key << endl;
-                PQclear(r);
                 res.status = 404;
                 auto end = chrono::high_resolution_clock::now();
                 cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
                 return;
             }
-            val = PQgetvalue(r, 0, 0);
-            PQclear(r);
-        }
 
-        {
-            lock_guard<mutex> lock(redis_mutex);
-            redisReply* r = (redisReply*)redisCommand(redis, "SET %s %s", key.c_str(), val.c_str());
-            if (r) freeReplyObject(r);
-        }
+            // Not over a value written since the read.
+            write_gens.if_unchanged(key, gen, [&]() {
+                cache_set(cache, cfg, key, val, fetch_us);
+                if (hot) replicate_hot(key, val);
+            });
 
-        cout << "[DB HIT] key=" << key << " loaded into cache" << endl;
-        res.set_content(val, "text/plain");
-        res.status = 200;
-        auto end = chrono::high_resolution_clock::now();
-        cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
-    });
+            cout << "[DB HIT] key=" << key << " loaded into cache" << endl;
+            res.set_content(val, "text/plain");
+            res.status = 200;
+            auto end = chrono::high_resolution_clock::now();
+            cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
+        });
 
-    svr.Delete(R"(/kv/(.*))", [&](const httplib::Request& req, httplib::Response& res) {
-        auto start = chrono::high_resolution_clock::now();
-        string key = req.matches[1];
-        cout << "[REQ] DELETE key=" << key << endl;
+        svr.Delete(R"(/kv/(.*))", [&](const httplib::Request& req, httplib::Response& res) {
+            auto start = chrono::high_resolution_clock::now();
+            string key = req.matches[1];
+            cout << "[REQ] DELETE key=" << key << endl;
 
-        {
-            lock_guard<mutex> lock(pg_mutex);
-            const char* params[1] = { key.c_str() };
-            PGresult* r = PQexecParams(pg, "DELETE FROM kv WHERE k=$1", 1, NULL, params, NULL, NULL, 0);
-            PQclear(r);
-        }
+            auto permit = db_writes.acquire();
+            if (!permit) {
+                reply_busy(res);
+                return;
+            }
+            if (deadline_expired()) {
+                reply_deadline(res);
+                return;
+            }
+            bool deleted = db.del(key);
+            // A failed delete may still have committed before its reply was
+            // lost, so the cache is evicted either way; the next GET reloads
+            // whatever storage holds.
+            {
+                DeadlineScope cleanup(Deadline::max());
+                write_gens.bump(key);
+                warmup_deletes.note(key);
+                cache.del(key);
+                drop_hot(key);
+            }
+            if (!deleted) {
+                if (deadline_expired()) reply_deadline(res);
+                else res.status = 500;
+                return;
+            }
 
-        {
-            lock_guard<mutex> lock(redis_mutex);
-            redisReply* r = (redisReply*)redisCommand(redis, "DEL %s", key.c_str());
-            if (r) freeReplyObject(r);
-        }
+            cout << "[DELETE] key=" << key << " removed from DB and Cache" << endl;
+            auto end = chrono::high_resolution_clock::now();
+            cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
+            res.status = 200;
+        });
 
-        cout << "[DELETE] key=" << key << " removed from DB and Cache" << endl;
-        auto end = chrono::high_resolution_clock::now();
-        cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
-        res.status = 200;
-    });
+        // Bulk upsert. Body: one "<key>\t<value>" per line. Rows are written in
+        // one storage batch (split per PG shard and run in parallel), then cached
+        // in one batch (one pipeline per Redis shard).
+        svr.Post("/kv_batch", [&](const httplib::Request& req, httplib::Response& res) {
+            auto start = chrono::high_resolution_clock::now();
+            StorageBackend::Rows rows;
+            size_t pos = 0;
+            while (pos < req.body.size()) {
+                size_t nl = req.body.find('\n', pos);
+                if (nl == string::npos) nl = req.body.size();
+                size_t tab = req.body.find('\t', pos);
+                if (tab == string::npos || tab > nl) {
+                    res.status = 400;
+                    res.set_content("Expected <key>\\t<value> per line\n", "text/plain");
+                    return;
+                }
+                rows.emplace_back(req.body.substr(pos, tab - pos), req.body.substr(tab + 1, nl - tab - 1));
+                pos = nl + 1;
+            }
+            cout << "[REQ] BATCH PUT rows=" << rows.size() << endl;
 
-    svr.Get("/check_cache", [&](const httplib::Request& req, httplib::Response& res) {
-        if (!req.has_param("key")) {
-            res.status = 400;
-            res.set_content("Missing key\n", "text/plain");
-            return;
-        }
+            auto permit = db_writes.acquire();
+            if (!permit) {
+                reply_busy(res);
+                return;
+            }
+            if (deadline_expired()) {
+                reply_deadline(res);
+                return;
+            }
+            if (!db.put_batch(rows)) {
+                // Shards that succeeded keep their rows, and a failed one may
+                // have committed before its reply was lost, so evict every
+                // row rather than leave an old value cached.
+                {
+                    DeadlineScope cleanup(Deadline::max());
+                    for (auto& row : rows) {
+                        write_gens.bump(row.first);
+                        cache.del(row.first);
+                        drop_hot(row.first);
+                    }
+                }
+                if (deadline_expired()) reply_deadline(res);
+                else res.status = 500;
+                return;
+            }
+            DeadlineScope committed(Deadline::max());
+            for (auto& row : rows) write_gens.bump(row.first);
+            cache_set_batch(cache, cfg, rows, CacheSetMode::Always);
+            for (auto& row : rows) drop_hot(row.first);
 
-        string key = req.get_param_value("key");
-        redisReply* reply = nullptr;
-        {
-            lock_guard<mutex> lock(redis_mutex);
-            reply = (redisReply*)redisCommand(redis, "EXISTS %s", key.c_str());
-        }
+            auto end = chrono::high_resolution_clock::now();
+            cout << "[TIME] " << chrono::duration<double, micro>(end - start).count() << " us\n";
+            res.set_content(to_string(rows.size()) + "\n", "text/plain");
+            res.status = 201;
+        });
 
-        if (!reply) {
-            res.status = 500;
-            res.set_content("Redis error\n", "text/plain");
-            return;
-        }
+        svr.Get("/check_cache", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!req.has_param("key")) {
+                res.status = 400;
+                res.set_content("Missing key\n", "text/plain");
+                return;
+            }
+
+            string key = req.get_param_value("key");
+            int found = cache.exists(key);
+
+            if (found < 0) {
+                if (deadline_expired()) {
+                    reply_deadline(res);
+                    return;
+                }
+                res.status = 500;
+                res.set_content("Cache error\n", "text/plain");
+                return;
+            }
+
+            if (found > 0) {
+                res.set_content("Key exists in cache\n", "text/plain");
+            } else {
+                res.status = 404;
+                res.set_content("Key not in cache\n", "text/plain");
+            }
+        });
+
+        // Current heavy hitters, most frequent first: "<key> <count> <error> <pinned>".
+        svr.Get("/admin/hot_keys", [&](const httplib::Request& req, httplib::Response& res) {
+            size_t n = 20;
+            if (req.has_param("n")) n = (size_t)atoi(req.get_param_value("n").c_str());
+
+            string out = "total " + to_string(hot_sketch.total_recorded()) + "\n";
+            for (auto& item : hot_sketch.top(n)) {
+                out += item.key + " " + to_string(item.count) + " " + to_string(item.error) +
+                       (hot_replica.pinned(item.key) ? " pinned\n" : " -\n");
+            }
+            res.set_content(out, "text/plain");
+        });
+
+        // Admission and shedding state: "<name> <value>" per line.
+        svr.Get("/admin/limits", [&](const httplib::Request&, httplib::Response& res) {
+            string out;
+            if (adaptive_limit) {
+                out += "adaptive_limit " + to_string(adaptive_limit->limit()) + "\n";
+                out += "adaptive_inflight " + to_string(adaptive_limit->inflight()) + "\n";
+                out += "adaptive_baseline_us " + to_string((long long)adaptive_limit->baseline_rtt_us()) + "\n";
+                out += "adaptive_rejected " + to_string(adaptive_limit->rejected()) + "\n";
+            }
+            out += "queue_shed " + to_string(shed_count.load()) + "\n";
+            out += "db_write_rejected " + to_string(db_writes.rejected()) + "\n";
+            out += "db_read_rejected " + to_string(db_reads.rejected()) + "\n";
+            res.set_content(out, "text/plain");
+        });
 
-        if (reply->integer > 0) {
-            res.set_content("Key exists in cache\n", "text/plain");
-        } else {
-            res.status = 404;
-            res.set_content("Key not in cache\n", "text/plain");
+        svr.Get("/ready", [&](const httplib::Request&, httplib::Response& res) {
+            if (ready) {
+                res.set_content("ready\n", "text/plain");
+            } else {
+                res.status = 503;
+                res.set_content("warming up\n", "text/plain");
+            }
+        });
+    };
+
+    // One listener normally; with --listeners=N, N SO_REUSEPORT sockets on
+    // the same port, each with its own accept thread, so the kernel spreads
+    // new connections across them.
+    size_t listener_count = (size_t)cfg.listeners;
+    vector<unique_ptr<httplib::Server>> servers;
+    for (size_t i = 0; i < listener_count; i++) {
+        servers.emplace_back(new SheddingServer(shed_pool));
+        setup_server(*servers.back());
+        int cpu = worker_cpus.empty() ? -1 : worker_cpus[i * worker_cpus.size() / listener_count];
+        if (!bind_listener(*servers.back(), "0.0.0.0", 8080, cfg.backlog, cpu)) {
+            cerr << "Failed to listen on port 8080" << endl;
+            return 1;
         }
+    }
+
+    cout << "Server running on http://localhost:8080";
+    if (listener_count > 1) cout << " (" << listener_count << " listeners)";
+    cout << endl;
+
+    vector<thread> accept_threads;
+    for (size_t i = 0; i < listener_count; i++) {
+        int cpu = worker_cpus.empty() ? -1 : worker_cpus[i * worker_cpus.size() / listener_count];
+        accept_threads.emplace_back([&servers, i, cpu]() {
+            if (cpu >= 0) pin_current_thread(cpu);
+            servers[i]->listen_after_bind();
+        });
+    }
 
-        freeReplyObject(reply);
+    // Stops the listeners on SIGINT/SIGTERM. Main then drains the workers
+    // and writes the final snapshot. If the listeners end on their own, the
+    // thread is woken with SIGTERM so it can be joined.
+    atomic<bool> listeners_done{false};
+    thread signal_thread([&]() {
+        int sig = 0;
+        sigwait(&stop_signals, &sig);
+        if (listeners_done) return;
+        cout << "Caught " << strsignal(sig) << ", shutting down" << endl;
+        for (auto& s : servers) {
+            s->wait_until_ready();
+            s->stop();
+        }
     });
 
-    cout << "Server running on http://localhost:8080" << endl;
-    svr.listen("0.0.0.0", 8080);
+    for (thread& t : accept_threads) t.join();
+    listeners_done = true;
+    pthread_kill(signal_thread.native_handle(), SIGTERM);
+    signal_thread.join();
+    workers.shutdown();
+    shed_pool.shutdown();
 
-    PQfinish(pg);
-    redisFree(redis);
+    if (warmup_thread.joinable()) warmup_thread.join();
+    if (snapshot_thread.joinable()) {
+        {
+            lock_guard<mutex> lock(snapshot_mutex);
+            stopping = true;
+        }
+        snapshot_cv.notify_all();
+        snapshot_thread.join();
+        write_snapshot();
+    }
     return 0;
 }